@@ -0,0 +1,201 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright 1991- The GROMACS Authors
+ * and the project initiators Erik Lindahl, Berk Hess and David van der Spoel.
+ * Consult the AUTHORS/COPYING files and https://www.gromacs.org for details.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * https://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at https://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out https://www.gromacs.org.
+ */
+#include "gmxpre.h"
+
+#include "clustmembership.h"
+
+#include <cstdint>
+#include <cstdio>
+
+#include <algorithm>
+#include <vector>
+
+#include "gromacs/utility/fatalerror.h"
+#include "gromacs/utility/futil.h"
+
+static const char c_membershipMagic[8] = { 'C', 'S', 'M', 'E', 'M', 'B', '0', '1' };
+
+struct t_membership_writer
+{
+    FILE*                fp;
+    int                  nmol;
+    bool                 bFirst;
+    std::vector<int32_t> prev;
+    std::vector<int32_t> buf;
+};
+
+struct t_membership_reader
+{
+    FILE*                fp;
+    const char*          fn;
+    int                  nmol;
+    std::vector<int32_t> labels;
+    std::vector<int32_t> buf;
+};
+
+static void membership_fwrite(const void* ptr, std::size_t size, std::size_t n, FILE* fp)
+{
+    if (fwrite(ptr, size, n, fp) != n)
+    {
+        gmx_fatal(FARGS, "Could not write to the cluster membership file");
+    }
+}
+
+static void membership_fread(void* ptr, std::size_t size, std::size_t n, const t_membership_reader* mr)
+{
+    if (fread(ptr, size, n, mr->fp) != n)
+    {
+        gmx_fatal(FARGS, "Cluster membership file %s is truncated or corrupted", mr->fn);
+    }
+}
+
+t_membership_writer* open_membership_writer(const char* fn, int nmol)
+{
+    t_membership_writer* mw = new t_membership_writer;
+    int32_t              n  = nmol;
+
+    mw->fp     = gmx_ffopen(fn, "wb");
+    mw->nmol   = nmol;
+    mw->bFirst = true;
+    mw->prev.resize(nmol);
+    membership_fwrite(c_membershipMagic, 1, sizeof(c_membershipMagic), mw->fp);
+    membership_fwrite(&n, sizeof(n), 1, mw->fp);
+
+    return mw;
+}
+
+void write_membership_frame(t_membership_writer* mw, double time, const int labels[])
+{
+    int32_t kind = 0;
+
+    mw->buf.clear();
+    if (!mw->bFirst)
+    {
+        /* Runs of molecules whose label changed */
+        mw->buf.push_back(0);
+        for (int i = 0; i < mw->nmol && static_cast<int>(mw->buf.size()) < mw->nmol;)
+        {
+            if (labels[i] == mw->prev[i])
+            {
+                i++;
+                continue;
+            }
+            int begin = i;
+            while (i < mw->nmol && labels[i] != mw->prev[i])
+            {
+                i++;
+            }
+            mw->buf.push_back(begin);
+            mw->buf.push_back(i - begin);
+            mw->buf.insert(mw->buf.end(), labels + begin, labels + i);
+            mw->buf[0]++;
+        }
+        kind = 1;
+    }
+    if (mw->bFirst || static_cast<int>(mw->buf.size()) >= mw->nmol)
+    {
+        mw->buf.assign(labels, labels + mw->nmol);
+        kind = 0;
+    }
+    membership_fwrite(&time, sizeof(time), 1, mw->fp);
+    membership_fwrite(&kind, sizeof(kind), 1, mw->fp);
+    membership_fwrite(mw->buf.data(), sizeof(int32_t), mw->buf.size(), mw->fp);
+
+    std::copy(labels, labels + mw->nmol, mw->prev.begin());
+    mw->bFirst = false;
+}
+
+void close_membership_writer(t_membership_writer* mw)
+{
+    gmx_ffclose(mw->fp);
+    delete mw;
+}
+
+t_membership_reader* open_membership_reader(const char* fn, int* nmol)
+{
+    t_membership_reader* mr = new t_membership_reader;
+    char                 magic[sizeof(c_membershipMagic)];
+    int32_t              n;
+
+    mr->fp = gmx_ffopen(fn, "rb");
+    mr->fn = fn;
+    membership_fread(magic, 1, sizeof(magic), mr);
+    if (!std::equal(magic, magic + sizeof(magic), c_membershipMagic))
+    {
+        gmx_fatal(FARGS, "%s is not a cluster membership file written by gmx clustsize", fn);
+    }
+    membership_fread(&n, sizeof(n), 1, mr);
+    mr->nmol = n;
+    mr->labels.assign(n, -1);
+    *nmol = n;
+
+    return mr;
+}
+
+gmx_bool read_membership_frame(t_membership_reader* mr, double* time, int labels[])
+{
+    int32_t kind, nrun, run[2];
+
+    if (fread(time, sizeof(*time), 1, mr->fp) != 1)
+    {
+        return FALSE;
+    }
+    membership_fread(&kind, sizeof(kind), 1, mr);
+    if (kind == 0)
+    {
+        membership_fread(mr->labels.data(), sizeof(int32_t), mr->nmol, mr);
+    }
+    else
+    {
+        membership_fread(&nrun, sizeof(nrun), 1, mr);
+        for (int r = 0; r < nrun; r++)
+        {
+            membership_fread(run, sizeof(int32_t), 2, mr);
+            if (run[0] < 0 || run[1] < 0 || run[0] + run[1] > mr->nmol)
+            {
+                gmx_fatal(FARGS, "Cluster membership file %s is corrupted", mr->fn);
+            }
+            membership_fread(mr->labels.data() + run[0], sizeof(int32_t), run[1], mr);
+        }
+    }
+    std::copy(mr->labels.begin(), mr->labels.end(), labels);
+
+    return TRUE;
+}
+
+void close_membership_reader(t_membership_reader* mr)
+{
+    gmx_ffclose(mr->fp);
+    delete mr;
+}
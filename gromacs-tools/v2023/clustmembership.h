@@ -0,0 +1,69 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright 1991- The GROMACS Authors
+ * and the project initiators Erik Lindahl, Berk Hess and David van der Spoel.
+ * Consult the AUTHORS/COPYING files and https://www.gromacs.org for details.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * https://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at https://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out https://www.gromacs.org.
+ */
+#ifndef GMX_GMXANA_CLUSTMEMBERSHIP_H
+#define GMX_GMXANA_CLUSTMEMBERSHIP_H
+
+#include "gromacs/utility/basedefinitions.h"
+
+/* Binary stream with the cluster label of every molecule for every analysed frame,
+ * as written by gmx clustsize. After a header with a magic string and the number of
+ * molecules, every frame is stored as its time (double) followed by either
+ *   0 (int32) and all labels (int32), or
+ *   1 (int32), the number of runs (int32) and for each run of consecutive molecules
+ *   whose label changed since the previous frame: first molecule, length and the new labels.
+ * The first frame is always stored in full, later ones whichever is smaller.
+ * Values are stored with the native byte order.
+ */
+struct t_membership_writer;
+struct t_membership_reader;
+
+t_membership_writer* open_membership_writer(const char* fn, int nmol);
+/* Open fn for writing the labels of nmol molecules */
+
+void write_membership_frame(t_membership_writer* mw, double time, const int labels[]);
+/* Append the labels of a frame */
+
+void close_membership_writer(t_membership_writer* mw);
+/* Close the file and free mw */
+
+t_membership_reader* open_membership_reader(const char* fn, int* nmol);
+/* Open fn for reading, returns the number of molecules in nmol */
+
+gmx_bool read_membership_frame(t_membership_reader* mr, double* time, int labels[]);
+/* Read the next frame into labels (nmol elements), returns FALSE at the end of the file */
+
+void close_membership_reader(t_membership_reader* mr);
+/* Close the file and free mr */
+
+#endif
@@ -34,10 +34,16 @@
 #include "gmxpre.h"
 
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
 
 #include <algorithm>
+#include <array>
 #include <functional> 
 #include <numeric>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "gromacs/commandline/filenm.h"
 #include "gromacs/commandline/pargs.h"
@@ -45,23 +51,1469 @@
 #include "gromacs/fileio/tpxio.h"
 #include "gromacs/fileio/trxio.h"
 #include "gromacs/fileio/xvgr.h"
+#include "gromacs/gmxana/clustmembership.h"
 #include "gromacs/gmxana/gmx_ana.h"
 #include "gromacs/gmxana/gstat.h"
 #include "gromacs/gmxlib/nrnb.h"
+#include "gromacs/math/functions.h"
 #include "gromacs/math/units.h"
 #include "gromacs/math/vec.h"
+#include "gromacs/math/vectypes.h"
 #include "gromacs/pbcutil/pbc.h"
 #include "gromacs/topology/index.h"
 #include "gromacs/topology/mtop_lookup.h"
 #include "gromacs/topology/mtop_util.h"
 #include "gromacs/topology/topology.h"
 #include "gromacs/trajectory/trajectoryframe.h"
+#include "gromacs/utility/alignedallocator.h"
 #include "gromacs/utility/arraysize.h"
 #include "gromacs/utility/cstringutil.h"
+#include "gromacs/utility/exceptions.h"
 #include "gromacs/utility/fatalerror.h"
 #include "gromacs/utility/futil.h"
 #include "gromacs/utility/gmxassert.h"
+#include "gromacs/utility/gmxomp.h"
 #include "gromacs/utility/smalloc.h"
+#include "gromacs/utility/stringutil.h"
+
+/* Find the root of the cluster element i belongs to, compressing the path on the way */
+static int cluster_find(int parent[], int i)
+{
+    int root = i;
+    while (parent[root] != root)
+    {
+        root = parent[root];
+    }
+    while (parent[i] != root)
+    {
+        int next  = parent[i];
+        parent[i] = root;
+        i         = next;
+    }
+    return root;
+}
+
+/* Merge the cluster with root rj into the one with root ri (union by size).
+ * The merged cluster keeps the label of ri, clust_size is indexed by label.
+ * Returns the root of the merged cluster.
+ */
+static int cluster_merge(int parent[], int label[], int clust_size[], int ri, int rj)
+{
+    int ci = label[ri];
+    int cj = label[rj];
+    if (clust_size[cj] <= 0)
+    {
+        gmx_fatal(FARGS, "negative cluster size %d for element %d", clust_size[cj], cj);
+    }
+    if (clust_size[ci] < clust_size[cj])
+    {
+        std::swap(ri, rj);
+    }
+    parent[rj] = ri;
+    label[ri]  = ci;
+    clust_size[ci] += clust_size[cj];
+    clust_size[cj] = 0;
+    return ri;
+}
+
+/* Cell list over a set of positions, with cells at least rcut wide, so that
+ * all pairs closer than rcut are found in the 27 neighbouring cells.
+ * With PBC the cells are wrapped, only rectangular boxes are supported.
+ */
+struct t_clust_grid
+{
+    int                    ncell[DIM] = { 0, 0, 0 };
+    rvec                   origin     = { 0, 0, 0 };
+    rvec                   inv_width  = { 0, 0, 0 };
+    gmx_bool               bPBC       = FALSE;
+    std::vector<int>       cell_start;
+    std::vector<int>       cell_elem;
+    std::vector<int>       elem_cell;
+    std::vector<gmx::IVec> elem_ci;
+};
+
+/* Put the n positions x in the grid. Returns FALSE when the grid cannot be used
+ * (triclinic or partially periodic box), in which case all pairs should be checked.
+ */
+static gmx_bool clust_grid_put(t_clust_grid* grid, int n, const rvec x[], const t_pbc* pbc, gmx_bool bPBC, real rcut)
+{
+    rvec xmin, xmax;
+
+    if (n == 0 || rcut <= 0)
+    {
+        return FALSE;
+    }
+    grid->bPBC = bPBC;
+    if (bPBC)
+    {
+        if (pbc->pbcType != PbcType::Xyz || pbc->box[YY][XX] != 0 || pbc->box[ZZ][XX] != 0
+            || pbc->box[ZZ][YY] != 0)
+        {
+            return FALSE;
+        }
+        for (int m = 0; (m < DIM); m++)
+        {
+            xmin[m] = 0;
+            xmax[m] = pbc->box[m][m];
+        }
+    }
+    else
+    {
+        copy_rvec(x[0], xmin);
+        copy_rvec(x[0], xmax);
+        for (int i = 1; (i < n); i++)
+        {
+            for (int m = 0; (m < DIM); m++)
+            {
+                xmin[m] = std::min(xmin[m], x[i][m]);
+                xmax[m] = std::max(xmax[m], x[i][m]);
+            }
+        }
+    }
+    /* Do not use more cells than a few per element, dilute systems would waste memory */
+    real width = rcut;
+    for (;;)
+    {
+        long ntot = 1;
+        for (int m = 0; (m < DIM); m++)
+        {
+            grid->ncell[m] = std::max(1, static_cast<int>((xmax[m] - xmin[m]) / width));
+            ntot *= grid->ncell[m];
+        }
+        if (ntot <= 8L * n + 64)
+        {
+            break;
+        }
+        width *= 1.25;
+    }
+    for (int m = 0; (m < DIM); m++)
+    {
+        grid->origin[m]    = xmin[m];
+        grid->inv_width[m] = grid->ncell[m] / std::max(xmax[m] - xmin[m], width);
+    }
+
+    int ncells = grid->ncell[XX] * grid->ncell[YY] * grid->ncell[ZZ];
+    grid->cell_start.assign(ncells + 1, 0);
+    grid->cell_elem.resize(n);
+    grid->elem_cell.resize(n);
+    grid->elem_ci.resize(n);
+    for (int i = 0; (i < n); i++)
+    {
+        for (int m = 0; (m < DIM); m++)
+        {
+            int c = static_cast<int>(std::floor((x[i][m] - grid->origin[m]) * grid->inv_width[m]));
+            if (bPBC)
+            {
+                c %= grid->ncell[m];
+                if (c < 0)
+                {
+                    c += grid->ncell[m];
+                }
+            }
+            else
+            {
+                c = std::min(std::max(c, 0), grid->ncell[m] - 1);
+            }
+            grid->elem_ci[i][m] = c;
+        }
+        grid->elem_cell[i] = (grid->elem_ci[i][XX] * grid->ncell[YY] + grid->elem_ci[i][YY]) * grid->ncell[ZZ]
+                             + grid->elem_ci[i][ZZ];
+        grid->cell_start[grid->elem_cell[i] + 1]++;
+    }
+    for (int c = 0; (c < ncells); c++)
+    {
+        grid->cell_start[c + 1] += grid->cell_start[c];
+    }
+    std::vector<int> fill(grid->cell_start.begin(), grid->cell_start.end() - 1);
+    for (int i = 0; (i < n); i++)
+    {
+        grid->cell_elem[fill[grid->elem_cell[i]]++] = i;
+    }
+
+    return TRUE;
+}
+
+/* Range of neighbouring cell offsets along dimension m for cell c, every cell is visited once */
+static void clust_grid_range(const t_clust_grid* grid, int m, int c, int* from, int* to)
+{
+    if (grid->bPBC)
+    {
+        if (grid->ncell[m] < 3)
+        {
+            *from = -c;
+            *to   = grid->ncell[m] - 1 - c;
+        }
+        else
+        {
+            *from = -1;
+            *to   = 1;
+        }
+    }
+    else
+    {
+        *from = (c > 0) ? -1 : 0;
+        *to   = (c < grid->ncell[m] - 1) ? 1 : 0;
+    }
+}
+
+/* Collect in jlist all elements j > i in the cells neighbouring the one of element i */
+static void clust_grid_neighbours(const t_clust_grid* grid, int i, std::vector<int>* jlist)
+{
+    int from[DIM], to[DIM];
+
+    jlist->clear();
+    for (int m = 0; (m < DIM); m++)
+    {
+        clust_grid_range(grid, m, grid->elem_ci[i][m], &from[m], &to[m]);
+    }
+    for (int dx = from[XX]; dx <= to[XX]; dx++)
+    {
+        int cx = (grid->elem_ci[i][XX] + dx + grid->ncell[XX]) % grid->ncell[XX];
+        for (int dy = from[YY]; dy <= to[YY]; dy++)
+        {
+            int cy = (grid->elem_ci[i][YY] + dy + grid->ncell[YY]) % grid->ncell[YY];
+            for (int dz = from[ZZ]; dz <= to[ZZ]; dz++)
+            {
+                int cz = (grid->elem_ci[i][ZZ] + dz + grid->ncell[ZZ]) % grid->ncell[ZZ];
+                int c  = (cx * grid->ncell[YY] + cy) * grid->ncell[ZZ] + cz;
+                for (int k = grid->cell_start[c]; k < grid->cell_start[c + 1]; k++)
+                {
+                    if (grid->cell_elem[k] > i)
+                    {
+                        jlist->push_back(grid->cell_elem[k]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Smallest distance squared between the positions in [ibegin,iend) and in [jbegin,jend),
+ * cut2 when none is closer than sqrt(cut2). With bFirst the search stops at the first
+ * pair closer than sqrt(cut2). The grid should hold all positions x, with cells at least
+ * sqrt(cut2) wide, positions are binned in increasing order so the ones of a range are
+ * contiguous in each cell.
+ */
+static real clust_grid_mindist2(const t_clust_grid* grid,
+                                const rvec          x[],
+                                int                 ibegin,
+                                int                 iend,
+                                int                 jbegin,
+                                int                 jend,
+                                const t_pbc*        pbc,
+                                real                cut2,
+                                gmx_bool            bFirst)
+{
+    int  from[DIM], to[DIM];
+    rvec dx;
+    real d2min = cut2;
+
+    /* Loop over the smallest range, search the other one in the cells */
+    if (iend - ibegin > jend - jbegin)
+    {
+        std::swap(ibegin, jbegin);
+        std::swap(iend, jend);
+    }
+    for (int p = ibegin; p < iend; p++)
+    {
+        const gmx::IVec& pci = grid->elem_ci[p];
+        for (int m = 0; (m < DIM); m++)
+        {
+            clust_grid_range(grid, m, pci[m], &from[m], &to[m]);
+        }
+        for (int ox = from[XX]; ox <= to[XX]; ox++)
+        {
+            int cx = (pci[XX] + ox + grid->ncell[XX]) % grid->ncell[XX];
+            for (int oy = from[YY]; oy <= to[YY]; oy++)
+            {
+                int cy = (pci[YY] + oy + grid->ncell[YY]) % grid->ncell[YY];
+                for (int oz = from[ZZ]; oz <= to[ZZ]; oz++)
+                {
+                    int  cz    = (pci[ZZ] + oz + grid->ncell[ZZ]) % grid->ncell[ZZ];
+                    int  c     = (cx * grid->ncell[YY] + cy) * grid->ncell[ZZ] + cz;
+                    auto first = grid->cell_elem.begin() + grid->cell_start[c];
+                    auto last  = grid->cell_elem.begin() + grid->cell_start[c + 1];
+                    for (auto q = std::lower_bound(first, last, jbegin); q != last && *q < jend; ++q)
+                    {
+                        if (grid->bPBC)
+                        {
+                            pbc_dx(pbc, x[p], x[*q], dx);
+                        }
+                        else
+                        {
+                            rvec_sub(x[p], x[*q], dx);
+                        }
+                        d2min = std::min(d2min, iprod(dx, dx));
+                        if (bFirst && d2min < cut2)
+                        {
+                            return d2min;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return d2min;
+}
+
+/* Check whether any position in [ibegin,iend) is closer than sqrt(cut2) to one in [jbegin,jend) */
+static gmx_bool clust_grid_contact(const t_clust_grid* grid,
+                                   const rvec          x[],
+                                   int                 ibegin,
+                                   int                 iend,
+                                   int                 jbegin,
+                                   int                 jend,
+                                   const t_pbc*        pbc,
+                                   real                cut2)
+{
+    return clust_grid_mindist2(grid, x, ibegin, iend, jbegin, jend, pbc, cut2, TRUE) < cut2;
+}
+
+/* Build the list of molecule pairs j > i whose centers are closer than
+ * min(mol_cut, rsphere[i] + rsphere[j] + cut) + skin, in start/jlist (CSR layout).
+ * As long as no molecule moves its center plus grows its bounding sphere by more than
+ * half of the skin, no pair outside the list can pass the tests of clust_size.
+ */
+static void clust_pairlist_build(int                nindex,
+                                 const rvec         xcm[],
+                                 const real         rsphere[],
+                                 const t_pbc*       pbc,
+                                 gmx_bool           bPBC,
+                                 real               mol_cut,
+                                 real               cut,
+                                 real               skin,
+                                 t_clust_grid*      grid,
+                                 std::vector<int>*  start,
+                                 std::vector<int>*  jlist)
+{
+    std::vector<int> jn;
+    rvec             dx;
+
+    real rmax = 0;
+    for (int i = 0; i < nindex; i++)
+    {
+        rmax = std::max(rmax, rsphere[i]);
+    }
+    gmx_bool bGrid = clust_grid_put(grid, nindex, xcm, pbc, bPBC, std::min(mol_cut, 2 * rmax + cut) + skin);
+
+    start->assign(1, 0);
+    jlist->clear();
+    for (int i = 0; i < nindex; i++)
+    {
+        if (bGrid)
+        {
+            clust_grid_neighbours(grid, i, &jn);
+        }
+        else
+        {
+            jn.resize(nindex - i - 1);
+            std::iota(jn.begin(), jn.end(), i + 1);
+        }
+        for (int j : jn)
+        {
+            if (bPBC)
+            {
+                pbc_dx(pbc, xcm[i], xcm[j], dx);
+            }
+            else
+            {
+                rvec_sub(xcm[i], xcm[j], dx);
+            }
+            if (iprod(dx, dx) < gmx::square(std::min(mol_cut, rsphere[i] + rsphere[j] + cut) + skin))
+            {
+                jlist->push_back(j);
+            }
+        }
+        start->push_back(jlist->size());
+    }
+}
+
+/* Edge of the single-linkage graph: the smallest distance squared between elements i < j */
+struct t_clust_edge
+{
+    real d2;
+    int  i;
+    int  j;
+};
+
+/* Collect in edges the pairs of elements closer than cmax, with their smallest distance squared.
+ * As in clust_size, pairs with centers xcm further apart than mol_cut are left out.
+ * With xa (-mol) the distance is the shortest one between the atoms of the two molecules,
+ * otherwise the one between the atoms x[index[i]] and x[index[j]].
+ */
+static void clust_cut_edges(int                        nindex,
+                            const int                  index[],
+                            const rvec                 x[],
+                            const rvec                 xcm[],
+                            const rvec                 xa[],
+                            const int                  xa_start[],
+                            const real                 rsphere[],
+                            const t_pbc*               pbc,
+                            gmx_bool                   bPBC,
+                            double                     mol_cut,
+                            double                     cmax,
+                            t_clust_grid*              grid,
+                            t_clust_grid*              agrid,
+                            std::vector<t_clust_edge>* edges)
+{
+    std::vector<int> jn;
+    rvec             dx;
+    double           mcut2 = mol_cut * mol_cut;
+    double           cmax2 = cmax * cmax;
+
+    real rmax = 0;
+    for (int i = 0; xa && i < nindex; i++)
+    {
+        rmax = std::max(rmax, rsphere[i]);
+    }
+    real     rgrid  = xa ? std::min<real>(mol_cut, 2 * rmax + cmax) : std::min<real>(mol_cut, cmax);
+    gmx_bool bGrid  = clust_grid_put(grid, nindex, xcm, pbc, bPBC, rgrid);
+    gmx_bool bAGrid = xa && clust_grid_put(agrid, xa_start[nindex], xa, pbc, bPBC, cmax);
+
+    edges->clear();
+    for (int i = 0; i < nindex; i++)
+    {
+        if (bGrid)
+        {
+            clust_grid_neighbours(grid, i, &jn);
+        }
+        else
+        {
+            jn.resize(nindex - i - 1);
+            std::iota(jn.begin(), jn.end(), i + 1);
+        }
+        for (int j : jn)
+        {
+            if (bPBC)
+            {
+                pbc_dx(pbc, xcm[i], xcm[j], dx);
+            }
+            else
+            {
+                rvec_sub(xcm[i], xcm[j], dx);
+            }
+            real d2 = iprod(dx, dx);
+            if (d2 > mcut2)
+            {
+                continue;
+            }
+            if (xa)
+            {
+                if (d2 > gmx::square(rsphere[i] + rsphere[j] + cmax))
+                {
+                    continue;
+                }
+                if (bAGrid)
+                {
+                    d2 = clust_grid_mindist2(
+                            agrid, xa, xa_start[i], xa_start[i + 1], xa_start[j], xa_start[j + 1], pbc, GMX_REAL_MAX, FALSE);
+                }
+                else
+                {
+                    d2 = GMX_REAL_MAX;
+                    for (int ii = xa_start[i]; ii < xa_start[i + 1]; ii++)
+                    {
+                        for (int jj = xa_start[j]; jj < xa_start[j + 1]; jj++)
+                        {
+                            if (bPBC)
+                            {
+                                pbc_dx(pbc, xa[ii], xa[jj], dx);
+                            }
+                            else
+                            {
+                                rvec_sub(xa[ii], xa[jj], dx);
+                            }
+                            d2 = std::min(d2, iprod(dx, dx));
+                        }
+                    }
+                }
+            }
+            else
+            {
+                if (bPBC)
+                {
+                    pbc_dx(pbc, x[index[i]], x[index[j]], dx);
+                }
+                else
+                {
+                    rvec_sub(x[index[i]], x[index[j]], dx);
+                }
+                d2 = iprod(dx, dx);
+            }
+            if (d2 < cmax2)
+            {
+                edges->push_back({ d2, i, j });
+            }
+        }
+    }
+}
+
+/* Single-linkage clustering for all cutoffs (ascending) at once: the edges are added in order
+ * of increasing length and the clusters are analysed each time a cutoff is passed.
+ * Stores the number of clusters and the largest cluster size for each cutoff and adds the
+ * cluster size distribution to hist (ncut rows of nindex sizes).
+ */
+static void clust_cut_sweep(int                        nindex,
+                            std::vector<t_clust_edge>* edges,
+                            const std::vector<double>& cuts,
+                            int                        parent[],
+                            int                        label[],
+                            int                        size[],
+                            int                        nclust[],
+                            int                        maxclust[],
+                            double                     hist[])
+{
+    std::sort(edges->begin(), edges->end(), [](const t_clust_edge& a, const t_clust_edge& b) {
+        return a.d2 < b.d2;
+    });
+    for (int i = 0; i < nindex; i++)
+    {
+        parent[i] = i;
+        label[i]  = i;
+        size[i]   = 1;
+    }
+    int         ncl  = nindex;
+    int         nmax = 1;
+    std::size_t e    = 0;
+    for (std::size_t c = 0; c < cuts.size(); c++)
+    {
+        double c2 = cuts[c] * cuts[c];
+        for (; e < edges->size() && (*edges)[e].d2 < c2; e++)
+        {
+            int ri = cluster_find(parent, (*edges)[e].i);
+            int rj = cluster_find(parent, (*edges)[e].j);
+            if (ri != rj)
+            {
+                ri = cluster_merge(parent, label, size, ri, rj);
+                ncl--;
+                nmax = std::max(nmax, size[label[ri]]);
+            }
+        }
+        nclust[c]   = ncl;
+        maxclust[c] = nmax;
+        for (int k = 0; k < nindex; k++)
+        {
+            if (size[k] > 0)
+            {
+                hist[c * nindex + size[k] - 1] += 1.0;
+            }
+        }
+    }
+}
+
+/* Centers of a set of molecules (or single atoms), the coordinates of each molecule are
+ * gathered in contiguous x/y/z buffers and made whole by taking for every atom the periodic
+ * image closest to the first atom of the molecule. The loops over the buffers are written
+ * so that the compiler can vectorize them.
+ */
+struct t_mol_centers
+{
+    std::vector<int>  start;
+    std::vector<int>  atom;
+    std::vector<real> w;
+    std::vector<real> invw;
+    std::vector<real> x, y, z;
+};
+
+/* List contiguously in atom the atoms of the nindex molecules index[] from mols, or the
+ * atoms index[] when mols is empty, those of element i start at start[i].
+ */
+static void elem_atoms_init(const gmx::RangePartitioning& mols,
+                            int                           nindex,
+                            const int                     index[],
+                            std::vector<int>*             start,
+                            std::vector<int>*             atom)
+{
+    start->resize(nindex + 1);
+    (*start)[0] = 0;
+    atom->clear();
+    for (int i = 0; (i < nindex); i++)
+    {
+        if (mols.numBlocks() > 0)
+        {
+            for (int a : mols.block(index[i]))
+            {
+                atom->push_back(a);
+            }
+        }
+        else
+        {
+            atom->push_back(index[i]);
+        }
+        (*start)[i + 1] = atom->size();
+    }
+}
+
+/* Set up the centers of the nindex molecules index[] from mols, or of the atoms index[]
+ * when mols is empty. With bMassW the centers are mass weighted, this needs mtop.
+ */
+static void mol_centers_init(t_mol_centers*                mc,
+                             const gmx::RangePartitioning& mols,
+                             int                           nindex,
+                             const int                     index[],
+                             const gmx_mtop_t*             mtop,
+                             gmx_bool                      bMassW)
+{
+    int molb = 0;
+
+    elem_atoms_init(mols, nindex, index, &mc->start, &mc->atom);
+    mc->w.resize(mc->atom.size());
+    for (std::size_t p = 0; p < mc->atom.size(); p++)
+    {
+        mc->w[p] = bMassW ? mtopGetAtomMass(*mtop, mc->atom[p], &molb) : 1.0;
+    }
+    mc->invw.resize(nindex);
+    for (int i = 0; (i < nindex); i++)
+    {
+        double tm = 0;
+        for (int p = mc->start[i]; p < mc->start[i + 1]; p++)
+        {
+            tm += mc->w[p];
+        }
+        mc->invw[i] = (tm > 0) ? 1.0 / tm : 0;
+    }
+    mc->x.resize(mc->atom.size());
+    mc->y.resize(mc->atom.size());
+    mc->z.resize(mc->atom.size());
+}
+
+/* Compute the centers xcm of the molecules from the coordinates x, pbc can be nullptr */
+static void mol_centers_calc(t_mol_centers* mc, const rvec x[], const t_pbc* pbc, rvec xcm[])
+{
+    const int nmol  = mc->start.size() - 1;
+    const int natom = mc->atom.size();
+    real*     buf[DIM] = { mc->x.data(), mc->y.data(), mc->z.data() };
+
+    for (int p = 0; p < natom; p++)
+    {
+        buf[XX][p] = x[mc->atom[p]][XX];
+        buf[YY][p] = x[mc->atom[p]][YY];
+        buf[ZZ][p] = x[mc->atom[p]][ZZ];
+    }
+    if (pbc)
+    {
+        /* Shift along the box vectors from the last one, so that triclinic boxes work */
+        for (int d = pbc->ndim_ePBC - 1; d >= 0; d--)
+        {
+            const real  bx  = pbc->box[d][XX];
+            const real  by  = pbc->box[d][YY];
+            const real  bz  = pbc->box[d][ZZ];
+            const real  inv = 1.0 / pbc->box[d][d];
+            const real* xd  = buf[d];
+            for (int i = 0; i < nmol; i++)
+            {
+                const int  begin = mc->start[i];
+                const int  end   = mc->start[i + 1];
+                const real ref   = xd[begin];
+                for (int p = begin + 1; p < end; p++)
+                {
+                    const real shift = std::floor((xd[p] - ref) * inv + 0.5);
+                    buf[XX][p] -= shift * bx;
+                    buf[YY][p] -= shift * by;
+                    buf[ZZ][p] -= shift * bz;
+                }
+            }
+        }
+    }
+    for (int i = 0; i < nmol; i++)
+    {
+        double sx = 0, sy = 0, sz = 0;
+        for (int p = mc->start[i]; p < mc->start[i + 1]; p++)
+        {
+            sx += mc->w[p] * buf[XX][p];
+            sy += mc->w[p] * buf[YY][p];
+            sz += mc->w[p] * buf[ZZ][p];
+        }
+        xcm[i][XX] = sx * mc->invw[i];
+        xcm[i][YY] = sy * mc->invw[i];
+        xcm[i][ZZ] = sz * mc->invw[i];
+    }
+}
+
+/* Atoms of every element with their masses, resolved once from the topology, so that
+ * the kinetic energy of the clusters needs no topology lookups.
+ */
+struct t_elem_masses
+{
+    std::vector<int>  start;
+    std::vector<int>  atom;
+    std::vector<real> mass;
+};
+
+static void elem_masses_init(t_elem_masses*                em,
+                             const gmx::RangePartitioning& mols,
+                             int                           nindex,
+                             const int                     index[],
+                             const gmx_mtop_t&             mtop)
+{
+    int molb = 0;
+
+    elem_atoms_init(mols, nindex, index, &em->start, &em->atom);
+    em->mass.resize(em->atom.size());
+    for (std::size_t p = 0; p < em->atom.size(); p++)
+    {
+        em->mass[p] = mtopGetAtomMass(mtop, em->atom[p], &molb);
+    }
+}
+
+/* Kinetic energy and number of atoms of every cluster, indexed by the labels clust_index
+ * of the nindex elements, from the velocities v
+ */
+static void clust_kinetic_energy(const t_elem_masses& em,
+                                 const rvec           v[],
+                                 int                  nindex,
+                                 const int            clust_index[],
+                                 double               ekin[],
+                                 int                  natoms[])
+{
+    std::fill(ekin, ekin + nindex, 0.0);
+    std::fill(natoms, natoms + nindex, 0);
+    for (int i = 0; (i < nindex); i++)
+    {
+        double mv2 = 0;
+        for (int p = em.start[i]; p < em.start[i + 1]; p++)
+        {
+            const rvec& va = v[em.atom[p]];
+            mv2 += static_cast<double>(em.mass[p]) * iprod(va, va);
+        }
+        ekin[clust_index[i]] += 0.5 * mv2;
+        natoms[clust_index[i]] += em.start[i + 1] - em.start[i];
+    }
+}
+
+/* Square matrix indexed by oligomer order. Only orders up to the largest one observed
+ * can have non-zero entries, so the storage is grown on demand rather than nindex^2.
+ */
+struct t_order_matrix
+{
+    int                 n = 0;
+    std::vector<double> m;
+};
+
+/* Make room for orders up to n, nmax is the largest possible order */
+static void order_matrix_reserve(t_order_matrix* mat, int n, int nmax)
+{
+    if (n <= mat->n)
+    {
+        return;
+    }
+    int                 nnew = std::min(std::max(n, 2 * mat->n), nmax);
+    std::vector<double> m(static_cast<std::size_t>(nnew) * nnew, 0.0);
+    for (int i = 0; i < mat->n; i++)
+    {
+        std::copy(mat->m.begin() + static_cast<std::size_t>(i) * mat->n,
+                  mat->m.begin() + static_cast<std::size_t>(i + 1) * mat->n,
+                  m.begin() + static_cast<std::size_t>(i) * nnew);
+    }
+    mat->m.swap(m);
+    mat->n = nnew;
+}
+
+/* Entry i,j (0-based orders), zero outside of the stored part */
+static inline double order_matrix_get(const t_order_matrix& mat, int i, int j)
+{
+    return (i < mat.n && j < mat.n) ? mat.m[static_cast<std::size_t>(i) * mat.n + j] : 0.0;
+}
+
+static inline double& order_matrix_at(t_order_matrix* mat, int i, int j)
+{
+    return mat->m[static_cast<std::size_t>(i) * mat->n + j];
+}
+
+/* Sort the elements by cluster label: the members of cluster c are members[start[c]] up to
+ * members[start[c+1]], in increasing order.
+ */
+static void clust_group(int nindex, const int clust_index[], std::vector<int>* start, std::vector<int>* members)
+{
+    start->assign(nindex + 1, 0);
+    members->resize(nindex);
+    for (int i = 0; i < nindex; i++)
+    {
+        (*start)[clust_index[i] + 1]++;
+    }
+    for (int c = 0; c < nindex; c++)
+    {
+        (*start)[c + 1] += (*start)[c];
+    }
+    std::vector<int> fill(start->begin(), start->end() - 1);
+    for (int i = 0; i < nindex; i++)
+    {
+        (*members)[fill[clust_index[i]]++] = i;
+    }
+}
+
+/* Archive with the oligomer memberships written with -tr_olig_ndx. After a header with
+ * the magic string and the largest order stored, there is one record per analysed frame:
+ *   frame (int32), time (double), number of clusters (int32),
+ *   and for each cluster, ordered by size and then by first molecule:
+ *   size (int32), label (int32), number of atom ranges (int32), the ranges [begin,end) (int32 pairs).
+ * The file ends with the table of the record offsets, number of frames times
+ * frame (int64) and offset (int64), followed by the offset of the table (int64) and the magic
+ * string again, so that a single frame can be found without reading the others.
+ * Values are stored with the native byte order.
+ */
+static const char c_oligMagic[8] = { 'C', 'S', 'O', 'L', 'I', 'G', '0', '1' };
+
+static void olig_fwrite(const void* ptr, std::size_t size, std::size_t n, FILE* fp)
+{
+    if (fwrite(ptr, size, n, fp) != n)
+    {
+        gmx_fatal(FARGS, "Could not write to the oligomer archive");
+    }
+}
+
+static void olig_fread(void* ptr, std::size_t size, std::size_t n, FILE* fp, const char* fn)
+{
+    if (fread(ptr, size, n, fp) != n)
+    {
+        gmx_fatal(FARGS, "Oligomer archive %s is truncated or corrupted", fn);
+    }
+}
+
+static void olig_archive_open(FILE* fp, int largest)
+{
+    int32_t l = largest;
+    olig_fwrite(c_oligMagic, 1, sizeof(c_oligMagic), fp);
+    olig_fwrite(&l, sizeof(l), 1, fp);
+}
+
+/* Write the record of a frame for the oligomers of size 2 to largest and add it to the table */
+static void olig_archive_frame(FILE*                         fp,
+                               int                           frame,
+                               double                        time,
+                               int                           largest,
+                               int                           nindex,
+                               const int                     clust_index[],
+                               const int                     index_size[],
+                               const gmx::RangePartitioning& mols,
+                               std::vector<int64_t>*         table)
+{
+    std::vector<int> start, members, clusters;
+    clust_group(nindex, clust_index, &start, &members);
+    for (int i = 0; i < nindex; i++)
+    {
+        /* the first molecule of a cluster gives its position in the list */
+        if (members[start[clust_index[i]]] == i && index_size[i] >= 2 && index_size[i] <= largest)
+        {
+            clusters.push_back(clust_index[i]);
+        }
+    }
+    std::stable_sort(clusters.begin(), clusters.end(), [&start](int a, int b) {
+        return start[a + 1] - start[a] < start[b + 1] - start[b];
+    });
+
+    std::vector<int32_t> buf;
+    buf.push_back(clusters.size());
+    for (int c : clusters)
+    {
+        buf.push_back(start[c + 1] - start[c]);
+        buf.push_back(c);
+        std::size_t nrange = buf.size();
+        buf.push_back(0);
+        for (int m = start[c]; m < start[c + 1]; m++)
+        {
+            auto block = mols.block(members[m]);
+            /* merge molecules that are contiguous in the topology */
+            if (buf[nrange] > 0 && buf.back() == *block.begin())
+            {
+                buf.back() = *block.end();
+            }
+            else
+            {
+                buf.push_back(*block.begin());
+                buf.push_back(*block.end());
+                buf[nrange]++;
+            }
+        }
+    }
+
+    int32_t f = frame;
+    table->push_back(frame);
+    table->push_back(gmx_ftell(fp));
+    olig_fwrite(&f, sizeof(f), 1, fp);
+    olig_fwrite(&time, sizeof(time), 1, fp);
+    olig_fwrite(buf.data(), sizeof(int32_t), buf.size(), fp);
+}
+
+static void olig_archive_close(FILE* fp, const std::vector<int64_t>& table)
+{
+    int64_t offset = gmx_ftell(fp);
+    olig_fwrite(table.data(), sizeof(int64_t), table.size(), fp);
+    olig_fwrite(&offset, sizeof(offset), 1, fp);
+    olig_fwrite(c_oligMagic, 1, sizeof(c_oligMagic), fp);
+    gmx_ffclose(fp);
+}
+
+/* Write an index file with the oligomers of the given size (all sizes when size <= 0)
+ * found in trajectory frame frame of the archive fn.
+ */
+static void olig_archive_extract(const char* fn, int frame, int size, const char* ndx)
+{
+    char    magic[sizeof(c_oligMagic)];
+    int64_t offset = 0;
+
+    FILE* fp = gmx_ffopen(fn, "rb");
+    olig_fread(magic, 1, sizeof(magic), fp, fn);
+    if (!std::equal(magic, magic + sizeof(magic), c_oligMagic))
+    {
+        gmx_fatal(FARGS, "%s is not an oligomer archive written by gmx clustsize", fn);
+    }
+    gmx_fseek(fp, -static_cast<gmx_off_t>(sizeof(offset) + sizeof(magic)), SEEK_END);
+    int64_t end = gmx_ftell(fp);
+    olig_fread(&offset, sizeof(offset), 1, fp, fn);
+    olig_fread(magic, 1, sizeof(magic), fp, fn);
+    if (!std::equal(magic, magic + sizeof(magic), c_oligMagic))
+    {
+        gmx_fatal(FARGS, "Oligomer archive %s is incomplete, the run did not finish", fn);
+    }
+
+    std::vector<int64_t> table((end - offset) / sizeof(int64_t));
+    gmx_fseek(fp, offset, SEEK_SET);
+    olig_fread(table.data(), sizeof(int64_t), table.size(), fp, fn);
+    std::size_t t = 0;
+    while (t < table.size() && table[t] != frame)
+    {
+        t += 2;
+    }
+    if (t >= table.size())
+    {
+        gmx_fatal(FARGS, "Frame %d is not stored in the oligomer archive %s", frame, fn);
+    }
+
+    int32_t f, nclust;
+    double  time;
+    gmx_fseek(fp, table[t + 1], SEEK_SET);
+    olig_fread(&f, sizeof(f), 1, fp, fn);
+    olig_fread(&time, sizeof(time), 1, fp, fn);
+    olig_fread(&nclust, sizeof(nclust), 1, fp, fn);
+    FILE* out = gmx_ffopen(ndx, "w");
+    for (int c = 0; c < nclust; c++)
+    {
+        int32_t head[3];
+        olig_fread(head, sizeof(int32_t), 3, fp, fn);
+        std::vector<int32_t> ranges(2 * head[2]);
+        olig_fread(ranges.data(), sizeof(int32_t), ranges.size(), fp, fn);
+        if (size > 0 && head[0] != size)
+        {
+            continue;
+        }
+        fprintf(out, "[ clust %i ]\n", head[1]);
+        for (int r = 0; r < head[2]; r++)
+        {
+            for (int a = ranges[2 * r]; a < ranges[2 * r + 1]; a++)
+            {
+                fprintf(out, "%d\n", a + 1);
+            }
+        }
+    }
+    gmx_ffclose(out);
+    gmx_ffclose(fp);
+    printf("Wrote the oligomers of frame %d (t = %g) to %s\n", frame, time, ndx);
+}
+
+/* Persistent identities of the clusters over the frames. A cluster takes the identity of
+ * the cluster of the previous frame with which it has a Jaccard index (shared members over
+ * the union of the members) larger than 0.5, which makes the match unique. The overlaps are
+ * counted in a hash map over the previous identities of the members.
+ * The time a cluster keeps its identity and its size is accumulated per oligomer order,
+ * fusions and fissions are written to an event list.
+ */
+struct t_clust_tracker
+{
+    /* identity of the cluster of each molecule in the previous frame, -1 before the first */
+    std::vector<int>              mol_id;
+    /* identity -> index in the per-cluster arrays of the previous frame */
+    std::unordered_map<int, int>  prev;
+    std::vector<int>              prev_ids, prev_size, prev_since, prev_cont;
+    int                           next_id = 0;
+    /* number of finished segments [order-1][analysed frames-1] */
+    std::vector<std::vector<int>> lifetime;
+    FILE*                         fp_ev = nullptr;
+};
+
+static void clust_track_init(t_clust_tracker* tr, int nindex, FILE* fp_ev)
+{
+    tr->mol_id.assign(nindex, -1);
+    tr->fp_ev = fp_ev;
+    if (fp_ev)
+    {
+        fprintf(fp_ev, "# time  fusion  id(size) <- previous id(shared molecules) ...\n");
+        fprintf(fp_ev, "# time  fission id(size) -> new id(shared molecules) ...\n");
+    }
+}
+
+/* Match the clusters of analysed frame frame at time with the ones of the previous frame */
+static void clust_track_frame(t_clust_tracker* tr, int frame, double time, int nindex, const int clust_index[])
+{
+    std::vector<int>                 start, members;
+    std::vector<int>                 cur_size, cur_since, cur_id;
+    std::vector<std::array<int, 3>>  links;
+    std::vector<std::pair<int, int>> ov_sorted;
+    std::unordered_map<int, int>     ov;
+
+    clust_group(nindex, clust_index, &start, &members);
+    tr->prev_cont.assign(tr->prev_size.size(), -1);
+    for (int c = 0; c < nindex; c++)
+    {
+        int size = start[c + 1] - start[c];
+        if (size == 0)
+        {
+            continue;
+        }
+        ov.clear();
+        for (int k = start[c]; k < start[c + 1]; k++)
+        {
+            if (tr->mol_id[members[k]] >= 0)
+            {
+                ov[tr->mol_id[members[k]]]++;
+            }
+        }
+        int best = -1;
+        ov_sorted.assign(ov.begin(), ov.end());
+        std::sort(ov_sorted.begin(), ov_sorted.end());
+        for (const auto& o : ov_sorted)
+        {
+            int pi = tr->prev[o.first];
+            if (2 * o.second > size + tr->prev_size[pi] - o.second)
+            {
+                best = o.first;
+            }
+        }
+        int id = (best >= 0) ? best : tr->next_id++;
+        int since = frame;
+        if (best >= 0)
+        {
+            int pi            = tr->prev[best];
+            tr->prev_cont[pi] = size;
+            if (tr->prev_size[pi] == size)
+            {
+                since = tr->prev_since[pi];
+            }
+        }
+        for (const auto& o : ov_sorted)
+        {
+            links.push_back({ tr->prev[o.first], id, o.second });
+        }
+        if (tr->fp_ev && ov_sorted.size() > 1)
+        {
+            fprintf(tr->fp_ev, "%14.6e  fusion  %d(%d) <-", time, id, size);
+            for (const auto& o : ov_sorted)
+            {
+                fprintf(tr->fp_ev, " %d(%d)", o.first, o.second);
+            }
+            fprintf(tr->fp_ev, "\n");
+        }
+        for (int k = start[c]; k < start[c + 1]; k++)
+        {
+            tr->mol_id[members[k]] = id;
+        }
+        cur_size.push_back(size);
+        cur_since.push_back(since);
+        cur_id.push_back(id);
+    }
+
+    /* Previous clusters that split over several new ones */
+    if (tr->fp_ev)
+    {
+        std::sort(links.begin(), links.end());
+        for (std::size_t l = 0; l < links.size();)
+        {
+            std::size_t end = l;
+            while (end < links.size() && links[end][0] == links[l][0])
+            {
+                end++;
+            }
+            if (end - l > 1)
+            {
+                fprintf(tr->fp_ev, "%14.6e  fission %d(%d) ->", time, tr->prev_ids[links[l][0]], tr->prev_size[links[l][0]]);
+                for (std::size_t k = l; k < end; k++)
+                {
+                    fprintf(tr->fp_ev, " %d(%d)", links[k][1], links[k][2]);
+                }
+                fprintf(tr->fp_ev, "\n");
+            }
+            l = end;
+        }
+    }
+
+    /* Close the segments of the clusters that disappeared or changed size */
+    for (std::size_t pi = 0; pi < tr->prev_size.size(); pi++)
+    {
+        if (tr->prev_cont[pi] != tr->prev_size[pi])
+        {
+            int order = tr->prev_size[pi];
+            int nfr   = frame - tr->prev_since[pi];
+            if (static_cast<int>(tr->lifetime.size()) < order)
+            {
+                tr->lifetime.resize(order);
+            }
+            if (static_cast<int>(tr->lifetime[order - 1].size()) < nfr)
+            {
+                tr->lifetime[order - 1].resize(nfr, 0);
+            }
+            tr->lifetime[order - 1][nfr - 1]++;
+        }
+    }
+
+    tr->prev.clear();
+    for (std::size_t k = 0; k < cur_id.size(); k++)
+    {
+        tr->prev[cur_id[k]] = k;
+    }
+    tr->prev_ids.swap(cur_id);
+    tr->prev_size.swap(cur_size);
+    tr->prev_since.swap(cur_since);
+}
+
+/* Write the distribution of the lifetimes per oligomer order and their average,
+ * dt is the time between analysed frames. Clusters still present at the end are not counted.
+ */
+static void clust_track_write(const t_clust_tracker& tr, double dt, const char* ltfn, const char* ltafn, const gmx_output_env_t* oenv)
+{
+    auto timeLabel = output_env_get_time_label(oenv);
+    int  maxlen    = 0;
+    for (const auto& l : tr.lifetime)
+    {
+        maxlen = std::max(maxlen, static_cast<int>(l.size()));
+    }
+    if (ltfn)
+    {
+        FILE* fp = xvgropen(ltfn, "Lifetime distribution of the oligomers", timeLabel, "# of oligomers of order #", oenv);
+        for (int n = 0; n < maxlen; n++)
+        {
+            fprintf(fp, "%14.6e ", (n + 1) * dt);
+            for (const auto& l : tr.lifetime)
+            {
+                fprintf(fp, " %8d", n < static_cast<int>(l.size()) ? l[n] : 0);
+            }
+            fprintf(fp, "\n");
+        }
+        xvgrclose(fp);
+    }
+    if (ltafn)
+    {
+        FILE* fp = xvgropen(ltafn, "Average lifetime of the oligomers", "Oligomers order", timeLabel, oenv);
+        for (std::size_t o = 0; o < tr.lifetime.size(); o++)
+        {
+            double nseg = 0, sum = 0;
+            for (std::size_t n = 0; n < tr.lifetime[o].size(); n++)
+            {
+                nseg += tr.lifetime[o][n];
+                sum += tr.lifetime[o][n] * (n + 1) * dt;
+            }
+            if (nseg > 0)
+            {
+                fprintf(fp, "%5zu  %14.6e  %10.0f\n", o + 1, sum / nseg, nseg);
+            }
+        }
+        xvgrclose(fp);
+    }
+}
+
+/* Work space for clustering a frame, every thread has its own */
+struct t_clust_work
+{
+    t_mol_centers          centers;
+    std::vector<gmx::RVec> xcm;
+    std::vector<int>       parent;
+    std::vector<int>       label;
+    /* Cell list of the centers, to avoid looping over all pairs */
+    t_clust_grid     grid;
+    std::vector<int> jlist;
+    /* With -mol: atoms gathered per molecule, bounding sphere radii and cell list of the atoms */
+    std::vector<gmx::RVec> xa;
+    std::vector<real>      rsphere;
+    t_clust_grid           agrid;
+    /* With -skin: pair list of the molecules and the state when it was built */
+    gmx_bool               bListSet   = FALSE;
+    int                    nlistbuild = 0;
+    std::vector<int>       pl_start, pl_j;
+    std::vector<gmx::RVec> xcm_ref;
+    std::vector<real>      rsphere_ref;
+    matrix                 box_ref;
+    /* With -cuts: single-linkage edges, clusters and the summed size distributions */
+    std::vector<t_clust_edge> cut_edges;
+    t_clust_grid              cut_grid, cut_agrid;
+    std::vector<int>          cut_parent, cut_label, cut_size;
+    std::vector<double>       cut_hist;
+};
+
+/* A trajectory frame waiting to be processed in order, with the clusters found in it */
+struct t_clust_frame
+{
+    gmx_bool               bAnalyse = FALSE;
+    gmx_bool               bTime    = FALSE;
+    gmx_bool               bStep    = FALSE;
+    gmx_bool               bV       = FALSE;
+    double                 time     = 0;
+    int64_t                step     = 0;
+    matrix                 box;
+    /* The coordinates and velocities, those of the trajectory frame itself when frames
+     * are not buffered, otherwise the copies in x and v */
+    const rvec *           px = nullptr, *pv = nullptr;
+    std::vector<gmx::RVec> x, v;
+    /* Cluster label of each element and cluster sizes indexed by label */
+    std::vector<int> clust_index, clust_size;
+    /* With -cuts: number of clusters and largest cluster for each cutoff */
+    std::vector<int> cut_ncl, cut_max;
+};
+
+/* Find the clusters in frame f: the cluster label of each element in f->clust_index and the
+ * cluster sizes, indexed by label, in f->clust_size. With cut_list also the clusters for each
+ * of those cutoffs, their size distributions are added to w->cut_hist.
+ * Only w and f are modified, so frames can be clustered in parallel.
+ */
+static void clust_frame(t_clust_work*                 w,
+                        t_clust_frame*                f,
+                        int                           nindex,
+                        const int                     index[],
+                        const gmx::RangePartitioning& mols,
+                        const int                     xa_start[],
+                        gmx_bool                      bMol,
+                        gmx_bool                      bPBC,
+                        PbcType                       pbcType,
+                        double                        cut,
+                        double                        mol_cut,
+                        double                        skin,
+                        const std::vector<double>&    cut_list)
+{
+    const rvec*    x            = f->px;
+    rvec*          xcm          = as_rvec_array(w->xcm.data());
+    rvec*          xa           = as_rvec_array(w->xa.data());
+    real*          rsphere      = w->rsphere.data();
+    int*           clust_parent = w->parent.data();
+    int*           clust_label  = w->label.data();
+    int*           clust_size   = f->clust_size.data();
+    const gmx_bool bPairList    = (bMol && skin > 0);
+    const double   mcut2        = mol_cut * mol_cut;
+    const double   cut2         = cut * cut;
+    t_pbc          pbc;
+    rvec           dx;
+    double         dx2;
+    gmx_bool       bSame, bGrid, bAGrid = FALSE;
+    int            i, j, ai, aj, ri, rj, ii, jj;
+
+    if (bPBC)
+    {
+        set_pbc(&pbc, pbcType, f->box);
+    }
+
+    /* Put all atoms/molecules in their own cluster, with size 1 */
+    for (i = 0; (i < nindex); i++)
+    {
+        /* Each element is the root of its own tree, labelled with its own index */
+        clust_parent[i] = i;
+        clust_label[i]  = i;
+        /* Cluster size is indexed with cluster number */
+        clust_size[i] = 1;
+    }
+    /* calculate the center of each molecule */
+    mol_centers_calc(&w->centers, x, bPBC ? &pbc : nullptr, xcm);
+
+    if (bMol)
+    {
+        /* Gather the atoms in molecule order and compute the bounding sphere of each molecule */
+        for (i = 0; (i < nindex); i++)
+        {
+            int p      = xa_start[i];
+            rsphere[i] = 0;
+            for (int a : mols.block(index[i]))
+            {
+                copy_rvec(x[a], xa[p]);
+                if (bPBC)
+                {
+                    pbc_dx(&pbc, xa[p], xcm[i], dx);
+                }
+                else
+                {
+                    rvec_sub(xa[p], xcm[i], dx);
+                }
+                rsphere[i] = std::max(rsphere[i], norm2(dx));
+                p++;
+            }
+            rsphere[i] = std::sqrt(rsphere[i]);
+        }
+        bAGrid = clust_grid_put(&w->agrid, xa_start[nindex], xa, &pbc, bPBC, cut);
+    }
+
+    if (bPairList)
+    {
+        /* Rebuild the pair list when the molecules (or the box) moved too much */
+        gmx_bool bRebuild = !w->bListSet;
+        if (!bRebuild)
+        {
+            real mmax = 0, dbox = 0;
+            for (i = 0; (i < nindex); i++)
+            {
+                if (bPBC)
+                {
+                    pbc_dx(&pbc, xcm[i], w->xcm_ref[i], dx);
+                }
+                else
+                {
+                    rvec_sub(xcm[i], w->xcm_ref[i], dx);
+                }
+                mmax = std::max(mmax, norm(dx) + std::max<real>(rsphere[i] - w->rsphere_ref[i], 0));
+            }
+            if (bPBC)
+            {
+                for (int m = 0; (m < DIM); m++)
+                {
+                    rvec_sub(f->box[m], w->box_ref[m], dx);
+                    dbox += norm(dx);
+                }
+            }
+            bRebuild = (2 * mmax + dbox >= skin);
+        }
+        if (bRebuild)
+        {
+            clust_pairlist_build(nindex, xcm, rsphere, &pbc, bPBC, mol_cut, cut, skin, &w->grid, &w->pl_start, &w->pl_j);
+            w->xcm_ref.assign(w->xcm.begin(), w->xcm.end());
+            w->rsphere_ref.assign(w->rsphere.begin(), w->rsphere.end());
+            copy_mat(f->box, w->box_ref);
+            w->bListSet = TRUE;
+            w->nlistbuild++;
+        }
+        bGrid = FALSE;
+    }
+    else
+    {
+        /* Pairs further apart than mol_cut are never considered, bin the centers */
+        bGrid = clust_grid_put(&w->grid, nindex, xcm, &pbc, bPBC, mol_cut);
+    }
+
+    /* Loop over atoms/molecules */
+    for (i = 0; (i < nindex); i++)
+    {
+        ai = index[i];
+        ri = cluster_find(clust_parent, i);
+
+        /* The order of the j does not matter, everything is merged in the cluster of i */
+        const int* jl;
+        int        njl;
+        if (bPairList)
+        {
+            jl  = w->pl_j.data() + w->pl_start[i];
+            njl = w->pl_start[i + 1] - w->pl_start[i];
+        }
+        else
+        {
+            if (bGrid)
+            {
+                clust_grid_neighbours(&w->grid, i, &w->jlist);
+            }
+            else
+            {
+                w->jlist.resize(nindex - i - 1);
+                std::iota(w->jlist.begin(), w->jlist.end(), i + 1);
+            }
+            jl  = w->jlist.data();
+            njl = w->jlist.size();
+        }
+
+        /* Loop over atoms/molecules (only half a matrix) */
+        for (int jn = 0; jn < njl; jn++)
+        {
+            j = jl[jn];
+
+            if (bPBC)
+            {
+                pbc_dx(&pbc, xcm[i], xcm[j], dx);
+            }
+            else
+            {
+                rvec_sub(xcm[i], xcm[j], dx);
+            }
+            dx2 = iprod(dx, dx);
+
+            if (dx2 > mcut2)
+            {
+                continue;
+            }
+
+            rj = cluster_find(clust_parent, j);
+            /* If they are not in the same cluster already */
+            if (ri != rj)
+            {
+                aj = index[j];
+
+                /* Compute distance */
+                if (bMol)
+                {
+                    GMX_RELEASE_ASSERT(mols.numBlocks() > 0, "Cannot access index[] from empty mols");
+                    bSame = FALSE;
+                    /* No contact possible when the bounding spheres are further apart than cut */
+                    if (dx2 > gmx::square(rsphere[i] + rsphere[j] + cut))
+                    {
+                        continue;
+                    }
+                    if (bAGrid)
+                    {
+                        bSame = clust_grid_contact(
+                                &w->agrid, xa, xa_start[i], xa_start[i + 1], xa_start[j], xa_start[j + 1], &pbc, cut2);
+                    }
+                    else
+                    {
+                        for (ii = xa_start[i]; !bSame && ii < xa_start[i + 1]; ii++)
+                        {
+                            for (jj = xa_start[j]; !bSame && jj < xa_start[j + 1]; jj++)
+                            {
+                                if (bPBC)
+                                {
+                                    pbc_dx(&pbc, xa[ii], xa[jj], dx);
+                                }
+                                else
+                                {
+                                    rvec_sub(xa[ii], xa[jj], dx);
+                                }
+                                dx2   = iprod(dx, dx);
+                                bSame = (dx2 < cut2);
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    if (bPBC)
+                    {
+                        pbc_dx(&pbc, x[ai], x[aj], dx);
+                    }
+                    else
+                    {
+                        rvec_sub(x[ai], x[aj], dx);
+                    }
+                    dx2   = iprod(dx, dx);
+                    bSame = (dx2 < cut2);
+                }
+                /* If distance less than cut-off */
+                if (bSame)
+                {
+                    /* Merge clusters: the cluster of j takes the label of the cluster of i */
+                    ri = cluster_merge(clust_parent, clust_label, clust_size, ri, rj);
+                }
+            }
+        }
+    }
+    for (i = 0; (i < nindex); i++)
+    {
+        f->clust_index[i] = clust_label[cluster_find(clust_parent, i)];
+    }
+
+    if (!cut_list.empty())
+    {
+        /* Same analysis for all cutoffs of -cuts from a single list of edges */
+        clust_cut_edges(nindex, index, x, xcm, bMol ? xa : nullptr, xa_start, rsphere, &pbc, bPBC, mol_cut, cut_list.back(), &w->cut_grid, &w->cut_agrid, &w->cut_edges);
+        clust_cut_sweep(nindex,
+                        &w->cut_edges,
+                        cut_list,
+                        w->cut_parent.data(),
+                        w->cut_label.data(),
+                        w->cut_size.data(),
+                        f->cut_ncl.data(),
+                        f->cut_max.data(),
+                        w->cut_hist.data());
+    }
+}
 
 static void clust_size(const char*             ndx,
                        const char*             trx,
@@ -73,15 +1525,27 @@ static void clust_size(const char*             ndx,
                        const char*             histo,
                        const char*             histotime,
                        const char*             clustime,
+                       const char*             clustbin,
+                       const char*             lifetime,
+                       const char*             avlifetime,
+                       const char*             events,
                        const char*             trmatrix,
                        const char*             kmatrix,
                        const char*             tempf,
+                       const char*             tempcf,
                        const char*             mcn,
+                       const char*             oligf,
+                       const char*             ncutf,
+                       const char*             mcutf,
+                       const char*             hcutf,
                        gmx_bool                bMol,
                        gmx_bool                bPBC,
+                       gmx_bool                bMassCenter,
                        const char*             tpr,
                        double                  cut,
                        double                  mol_cut,
+                       double                  skin,
+                       const std::vector<double>& cut_list,
                        int                     bOndx,
                        int                     nskip,
                        int                     skip_last_nmol,
@@ -89,30 +1553,52 @@ static void clust_size(const char*             ndx,
                        t_rgb                   rmid,
                        t_rgb                   rhi,
                        int                     ndf,
+                       int                     nthreads,
                        const gmx_output_env_t* oenv)
 {
-    FILE *       fp, *gp, *hp, *tp, *cndx;
+    FILE *       fp, *gp, *hp, *tp, *tcp = nullptr, *cndx = nullptr, *olig = nullptr;
+    t_membership_writer* membw;
+    /* Persistent cluster identities, only when lifetimes or events are requested */
+    t_clust_tracker      tracker;
+    gmx_bool             bTrack = (lifetime || avlifetime || events);
+    std::vector<int64_t> olig_table;
     int*         index = nullptr;
     int          nindex, natoms;
     t_trxstatus* status;
-    rvec *       x = nullptr, *v = nullptr, *xcm = nullptr, dx;
-    t_pbc        pbc;
-    gmx_bool     bSame, bTPRwarn = TRUE;
+    const rvec*  v = nullptr;
+    gmx_bool     bTPRwarn = TRUE;
     /* Topology stuff */
     t_trxframe    fr;
     TpxFileHeader tpxh;
     gmx_mtop_t    mtop;
     PbcType       pbcType = PbcType::Unset;
-    int           ii, jj;
     double        temp, tfac;
-    /* Cluster size distribution (matrix) */
-    double** cs_dist = nullptr;
-    double** tr_matrix = nullptr;
-    double** rate_matrix = nullptr;
+    /* Masses of the atoms of every element, and kinetic energy and atoms of every cluster */
+    t_elem_masses       masses;
+    std::vector<double> clust_ekin;
+    std::vector<int>    clust_natoms;
+    /* Cluster size distribution of the current and previous frame, and summed over the frames */
+    double * cs_cur = nullptr, *cs_prev = nullptr, *cs_sum = nullptr;
+    int      cur_max_size = 0, prev_max_size = 0;
+    /* Time resolved distribution, only the occupied sizes of each frame are stored */
+    std::vector<int> cs_frame_start(1, 0);
+    std::vector<int> cs_occ_size;
+    std::vector<int> cs_occ_num;
+    t_order_matrix tr_matrix;
+    t_order_matrix rate_matrix;
     double* norm_matrix = nullptr;
+    /* prefix sums of order*number of oligomers of the previous frame, for k_on */
+    double* cs_prefix = nullptr;
     bool* norm_done = nullptr;
-    double   tf, dx2, cut2, mcut2, *t_x = nullptr, *t_y, cmid, cmax, cav, ekin;
-    int    i, j, k, ai, aj, ci, cj, nframe, nclust, n_x, max_size = 0;
+    double   tf, *t_x = nullptr, *t_y, cmid, cmax, cav;
+    int    i, j, k, ci, nframe, nclust, n_x, max_size = 0;
+    /* With -mol: start of the atoms of each molecule when gathered in molecule order */
+    int* xa_start = nullptr;
+    /* With -cuts: files and summed size distributions for each cutoff */
+    FILE *                   ncp = nullptr, *mcp = nullptr;
+    std::vector<double>      cut_hist;
+    std::vector<std::string> cut_legend;
+    int                      cut_max_size = 0;
     int *  clust_index, *index_size, *index_old_size, *clust_size, *clust_written, max_clust_size, max_clust_ind, nav, nhisto;
     t_rgb  rlo          = { 1.0, 1.0, 1.0 };
     int    frameCounter = 0;
@@ -132,7 +1618,6 @@ static void clust_size(const char*             ndx,
     }
 
     natoms = fr.natoms;
-    x      = fr.x;
 
     if (tpr)
     {
@@ -176,24 +1661,72 @@ static void clust_size(const char*             ndx,
         rd_index(ndx, 1, &nindex, &index, &gname);
         sfree(gname);
     }
-
-    snew(clust_index, nindex);
-    snew(index_size, nindex);
-    snew(index_old_size, nindex);
-    snew(clust_size, nindex);
-    snew(xcm, nindex);
-    /* transition matrix */
-    snew(tr_matrix, nindex);
-    for(i=0;i<nindex;i++) snew(tr_matrix[i], nindex);
-    /* rate matrix */
-    snew(rate_matrix, nindex);
-    for(i=0;i<nindex;i++) snew(rate_matrix[i], nindex);
+
+    snew(clust_index, nindex);
+    snew(index_size, nindex);
+    snew(index_old_size, nindex);
+    snew(clust_size, nindex);
+    if (bMol)
+    {
+        snew(xa_start, nindex + 1);
+        for (i = 0; (i < nindex); i++)
+        {
+            xa_start[i + 1] = xa_start[i] + mols.block(index[i]).size();
+        }
+    }
+
+    /* Frames are clustered in batches by the threads, the results are then processed
+     * in trajectory order, so that the output does not depend on the number of threads.
+     */
+    const int                  nbuf = (nthreads > 1) ? 4 * nthreads : 1;
+    std::vector<t_clust_work>  work(nthreads);
+    std::vector<t_clust_frame> frames(nbuf);
+    for (t_clust_work& w : work)
+    {
+        mol_centers_init(&w.centers, mols, nindex, index, &mtop, bMassCenter);
+        w.xcm.resize(nindex);
+        w.parent.resize(nindex);
+        w.label.resize(nindex);
+        if (bMol)
+        {
+            w.xa.resize(xa_start[nindex]);
+            w.rsphere.resize(nindex);
+        }
+        if (!cut_list.empty())
+        {
+            w.cut_parent.resize(nindex);
+            w.cut_label.resize(nindex);
+            w.cut_size.resize(nindex);
+            w.cut_hist.assign(cut_list.size() * nindex, 0.0);
+        }
+    }
+    for (t_clust_frame& f : frames)
+    {
+        f.clust_index.resize(nindex);
+        f.clust_size.resize(nindex);
+        f.cut_ncl.resize(cut_list.size());
+        f.cut_max.resize(cut_list.size());
+    }
+    if (!cut_list.empty())
+    {
+        for (double c : cut_list)
+        {
+            cut_legend.push_back(gmx::formatString("cut %g nm", c));
+        }
+        ncp = xvgropen(ncutf, "Number of clusters", timeLabel, "N", oenv);
+        xvgrLegend(ncp, cut_legend, oenv);
+        mcp = xvgropen(mcutf, "Max cluster size", timeLabel, "#molecules", oenv);
+        xvgrLegend(mcp, cut_legend, oenv);
+    }
+    /* cs_prefix[n] is the number of molecules in oligomers of order up to n */
+    snew(cs_prefix, nindex + 1);
+    snew(cs_cur, nindex);
+    snew(cs_prev, nindex);
+    snew(cs_sum, nindex);
     /* norm needed to calculate the rate and transition matrices */
     snew(norm_matrix, nindex);
     /* flag to accumulate correctly the norm matrix */
     snew(norm_done, nindex);
-    mcut2 = mol_cut*mol_cut;
-    cut2   = cut * cut;
     // total number of trajectory frames
     nframe = 0;
     // number of analysed frames
@@ -205,165 +1738,124 @@ static void clust_size(const char*             ndx,
     }
     max_clust_size = 1;
     max_clust_ind  = -1;
-    int molb       = 0;
-    cndx = xvgropen(clustime, "Index of the oligomer to which each monomer belongs", timeLabel, "Monomer index", oenv);
-    double frameTimeStep=1.;
+    if (tpr)
+    {
+        elem_masses_init(&masses, mols, nindex, index, mtop);
+        clust_ekin.resize(nindex);
+        clust_natoms.resize(nindex);
+        if (tempcf)
+        {
+            tcp = gmx_ffopen(tempcf, "w");
+            fprintf(tcp, "# %10s  %8s  %8s  %8s  %10s\n", "time", "cluster", "size", "atoms", "T (K)");
+        }
+    }
+    if ((bOndx > 1) && (bMol))
+    {
+        olig = gmx_ffopen(oligf, "wb");
+        olig_archive_open(olig, bOndx);
+    }
+    if (clustime)
+    {
+        cndx = xvgropen(clustime, "Index of the oligomer to which each monomer belongs", timeLabel, "Monomer index", oenv);
+    }
+    membw = clustbin ? open_membership_writer(clustbin, nindex) : nullptr;
+    if (bTrack)
+    {
+        clust_track_init(&tracker, nindex, events ? gmx_ffopen(events, "w") : nullptr);
+    }
+    double   frameTimeStep = 1.;
+    gmx_bool bMore         = TRUE;
+    int      nbatch = 0, b = 0;
     do
     {
-        if(nframe==1&&fr.bTime) frameTimeStep=fr.time;
-        if ((nskip == 0) || ((nskip > 0) && ((nframe % nskip) == 0)))
+        if (b == nbatch)
         {
-            if (bPBC)
-            {
-                set_pbc(&pbc, pbcType, fr.box);
-            }
-            max_clust_size = 1;
-            max_clust_ind  = -1;
-
-            /* Put all atoms/molecules in their own cluster, with size 1 */
-            for (i = 0; (i < nindex); i++)
+            /* Read the next frames into the buffer and cluster them in parallel */
+            for (nbatch = 0; bMore && nbatch < nbuf; nbatch++)
             {
-                /* Cluster index is indexed with atom index number */
-                clust_index[i] = i;
-                /* Cluster size is indexed with cluster number */
-                clust_size[i] = 1;
-                /* Initially each molecule belongs to a cluster of size 1 */
-                index_size[i] = 1;
-                /* Flag to accumulate the norm matrix */
-                norm_done[i] = FALSE;
-            }
-            /* calculate the center of each molecule */
-            for (i = 0; (i < nindex); i++)
-            {   
-                clear_rvec(xcm[i]);
-                ai = index[i];
-                double tm = 0.;
-                for (ii = mols.block(ai).begin(); ii < mols.block(ai).end(); ii++)
-                {
-                    for (int m = 0; (m < DIM); m++)
-                    {
-                        xcm[i][m] += x[ii][m];
-                    }
-                    tm += 1.0; 
-                }
-                for (int m = 0; (m < DIM); m++)
+                t_clust_frame& f = frames[nbatch];
+                f.bAnalyse = ((nskip == 0) || ((nskip > 0) && (((nframe + nbatch) % nskip) == 0)));
+                f.bTime    = fr.bTime;
+                f.bStep    = fr.bStep;
+                f.time     = fr.time;
+                f.step     = fr.step;
+                copy_mat(fr.box, f.box);
+                f.bV = fr.bV;
+                if (nbuf == 1)
                 {
-                    xcm[i][m] /= tm;
+                    /* A single frame is processed before the next one is read, no copy needed */
+                    f.px = fr.x;
+                    f.pv = fr.v;
                 }
-            }
-
-            /* Loop over atoms/molecules */
-            for (i = 0; (i < nindex); i++)
-            {
-                ai = index[i];
-                ci = clust_index[i];
-
-                /* Loop over atoms/molecules (only half a matrix) */
-                for (j = i + 1; (j < nindex); j++)
+                else
                 {
-                    cj = clust_index[j];
-
-                    if (bPBC)
+                    if (f.bAnalyse)
                     {
-                        pbc_dx(&pbc, xcm[i], xcm[j], dx);
+                        f.x.assign(fr.x, fr.x + natoms);
+                        f.px = as_rvec_array(f.x.data());
                     }
-                    else
+                    if (fr.bV && tpr)
                     {
-                        rvec_sub(xcm[i], xcm[j], dx);
+                        f.v.assign(fr.v, fr.v + natoms);
+                        f.pv = as_rvec_array(f.v.data());
                     }
-                    dx2   = iprod(dx, dx);
-
-                    if (dx2 > mcut2) continue;
-
-                    /* If they are not in the same cluster already */
-                    if (ci != cj)
+                    bMore = read_next_frame(oenv, status, &fr);
+                }
+            }
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+            for (int n = 0; n < nbatch; n++)
+            {
+                try
+                {
+                    if (frames[n].bAnalyse)
                     {
-                        aj = index[j];
-
-                        /* Compute distance */
-                        if (bMol)
-                        {
-                            GMX_RELEASE_ASSERT(mols.numBlocks() > 0,
-                                               "Cannot access index[] from empty mols");
-                            bSame = FALSE;
-                            for (ii = mols.block(ai).begin(); !bSame && ii < mols.block(ai).end(); ii++)
-                            {
-                                for (jj = mols.block(aj).begin(); !bSame && jj < mols.block(aj).end(); jj++)
-                                {
-                                    if (bPBC)
-                                    {
-                                        pbc_dx(&pbc, x[ii], x[jj], dx);
-                                    }
-                                    else
-                                    {
-                                        rvec_sub(x[ii], x[jj], dx);
-                                    }
-                                    dx2   = iprod(dx, dx);
-                                    bSame = (dx2 < cut2);
-                                }
-                            }
-                        }
-                        else
-                        {
-                            if (bPBC)
-                            {
-                                pbc_dx(&pbc, x[ai], x[aj], dx);
-                            }
-                            else
-                            {
-                                rvec_sub(x[ai], x[aj], dx);
-                            }
-                            dx2   = iprod(dx, dx);
-                            bSame = (dx2 < cut2);
-                        }
-                        /* If distance less than cut-off */
-                        if (bSame)
-                        {
-                            /* Merge clusters: check for all atoms whether they are in
-                             * cluster cj and if so, put them in ci
-                             */
-                            for (k = 0; (k < nindex); k++)
-                            {
-                                if (clust_index[k] == cj)
-                                {
-                                    if (clust_size[cj] <= 0)
-                                    {
-                                        gmx_fatal(FARGS,
-                                                  "negative cluster size %d for element %d",
-                                                  clust_size[cj],
-                                                  cj);
-                                    }
-                                    clust_size[cj]--;
-                                    clust_index[k] = ci;
-                                    clust_size[ci]++;
-                                }
-                            }
-                        }
+                        clust_frame(&work[gmx_omp_get_thread_num()], &frames[n], nindex, index, mols, xa_start, bMol, bPBC, pbcType, cut, mol_cut, skin, cut_list);
                     }
                 }
+                GMX_CATCH_ALL_AND_EXIT_WITH_FATAL_ERROR
             }
+            b = 0;
+        }
+        const t_clust_frame& f = frames[b++];
+
+        if(nframe==1&&f.bTime) frameTimeStep=f.time;
+        if (f.bAnalyse)
+        {
+            max_clust_size = 1;
+            max_clust_ind  = -1;
+            std::copy(f.clust_index.begin(), f.clust_index.end(), clust_index);
+            std::copy(f.clust_size.begin(), f.clust_size.end(), clust_size);
             for (k = 0; (k < nindex); k++)
             {
                  // this tells how large is the cluster to which each molecule belongs
                  index_size[k] = clust_size[clust_index[k]];
+                 /* Flag to accumulate the norm matrix */
+                 norm_done[k] = FALSE;
             }
             n_x++;
             srenew(t_x, n_x);
-            if (fr.bTime)
+            if (f.bTime)
             {
-                frameTime = fr.time;
+                frameTime = f.time;
             }
-            else if (fr.bStep)
+            else if (f.bStep)
             {
-                frameTime = fr.step;
+                frameTime = f.step;
             }
             else
             {
                 frameTime = ++frameCounter;
             }
             t_x[n_x - 1] = frameTime * tf;
-            srenew(cs_dist, n_x);
-            snew(cs_dist[n_x - 1], nindex);
+            if (bTrack)
+            {
+                clust_track_frame(&tracker, n_x - 1, t_x[n_x - 1], nindex, clust_index);
+            }
+            /* the distribution of the last frame becomes the previous one, reuse the older one */
+            std::swap(cs_prev, cs_cur);
+            std::swap(prev_max_size, cur_max_size);
+            std::fill(cs_cur, cs_cur + cur_max_size, 0.0);
+            cur_max_size = 0;
             nclust = 0;
             cav    = 0;
             nav    = 0;
@@ -380,8 +1872,8 @@ static void clust_size(const char*             ndx,
                     nclust++;
                     /* this is the cluster size time-resolved distribution 
                        that is cs[frame][i]=# of oligomers of order (i+1) */
-                    cs_dist[n_x - 1][ci - 1] += 1.0;
-                    max_size = std::max(max_size, ci);
+                    cs_cur[ci - 1] += 1.0;
+                    cur_max_size = std::max(cur_max_size, ci);
                     if (ci > 1)
                     {
                         cav += ci;
@@ -389,36 +1881,66 @@ static void clust_size(const char*             ndx,
                     }
                 }
             }
+            max_size = std::max(max_size, cur_max_size);
+            for (j = 0; (j < cur_max_size); j++)
+            {
+                if (cs_cur[j] > 0)
+                {
+                    cs_occ_size.push_back(j + 1);
+                    cs_occ_num.push_back(static_cast<int>(cs_cur[j]));
+                    cs_sum[j] += cs_cur[j];
+                }
+            }
+            cs_frame_start.push_back(cs_occ_size.size());
             fprintf(fp, "%14.6e  %10d\n", frameTime, nclust);
             if (nav > 0)
             {
                 fprintf(gp, "%14.6e  %10.3f\n", frameTime, cav / nav);
             }
             fprintf(hp, "%14.6e  %10d\n", frameTime, max_clust_size);
+            if (!cut_list.empty())
+            {
+                fprintf(ncp, "%14.6e", frameTime);
+                fprintf(mcp, "%14.6e", frameTime);
+                for (std::size_t c = 0; c < cut_list.size(); c++)
+                {
+                    fprintf(ncp, "  %10d", f.cut_ncl[c]);
+                    fprintf(mcp, "  %10d", f.cut_max[c]);
+                }
+                fprintf(ncp, "\n");
+                fprintf(mcp, "\n");
+                cut_max_size = std::max(cut_max_size, f.cut_max.back());
+            }
             /* update the transition matrix */
             if (n_x>1) 
             {
-                double Volume = det(fr.box)*0.0006022;  // NA * nm3->m3
+                double Volume = det(f.box)*0.0006022;  // NA * nm3->m3
                 double Volume2 = Volume*Volume;
+                /* the transition and rate matrices are grown up to the largest oligomer order found */
+                order_matrix_reserve(&tr_matrix, std::max(cur_max_size, prev_max_size), nindex);
+                order_matrix_reserve(&rate_matrix, std::max(cur_max_size, prev_max_size), nindex);
+                /* cs_prefix[n] is the number of molecules in oligomers of order up to n */
+                cs_prefix[0] = 0;
+                for (j = 0; j < cur_max_size; j++)
+                {
+                    cs_prefix[j + 1] = (j < prev_max_size) ? cs_prefix[j] + cs_prev[j] * ((double)(j + 1)) : cs_prefix[j];
+                }
                 for(i=0;i<nindex;i++)
                 {
                    // transition from an oligomer of order index_old_size[i] to on of order index_size[i] 
-                   if(cs_dist[n_x-2][index_old_size[i]-1]>0.)
+                   if(cs_prev[index_old_size[i]-1]>0.)
                    {
-                     tr_matrix[index_size[i]-1][index_old_size[i]-1]+=1./(cs_dist[n_x-2][index_old_size[i]-1]*((double)index_old_size[i]));
+                     order_matrix_at(&tr_matrix, index_size[i]-1, index_old_size[i]-1)+=1./(cs_prev[index_old_size[i]-1]*((double)index_old_size[i]));
                      if(index_old_size[i]>index_size[i]) {
                        /* k_off */
                        /* this is 1/([oligomer]) that are dissociating */
-                       rate_matrix[index_size[i]-1][index_old_size[i]-1]+=Volume/(cs_dist[n_x-2][index_old_size[i]-1]*((double)index_old_size[i]));
+                       order_matrix_at(&rate_matrix, index_size[i]-1, index_old_size[i]-1)+=Volume/(cs_prev[index_old_size[i]-1]*((double)index_old_size[i]));
                      } else if(index_old_size[i]<index_size[i]){
                        /* k_on */
                        /* this is 1/([oligomer_ligand][oligomer_reactants]) that are associating */
-                       double fact=0;
-                       for(j=0;j<(index_size[i]-index_old_size[i]);j++) {
-                         fact+=cs_dist[n_x-2][j]*((double)(j+1));
-                       }
+                       double fact = cs_prefix[index_size[i]-index_old_size[i]];
                        fact -= index_old_size[i];
-                       rate_matrix[index_size[i]-1][index_old_size[i]-1]+=Volume2/(cs_dist[n_x-2][index_old_size[i]-1]*((double)index_old_size[i])*fact);
+                       order_matrix_at(&rate_matrix, index_size[i]-1, index_old_size[i]-1)+=Volume2/(cs_prev[index_old_size[i]-1]*((double)index_old_size[i])*fact);
                      }
  
                      if(!norm_done[index_old_size[i]-1]) norm_matrix[index_old_size[i]-1]+=1.0;
@@ -430,7 +1952,7 @@ static void clust_size(const char*             ndx,
             for(i=0;i<nindex;i++) index_old_size[i] = index_size[i]; 
         }
         /* Analyse velocities, if present */
-        if (fr.bV)
+        if (f.bV)
         {
             if (!tpr)
             {
@@ -442,70 +1964,81 @@ static void clust_size(const char*             ndx,
             }
             else
             {
-                v = fr.v;
-                /* Loop over clusters and for each cluster compute 1/2 m v^2 */
+                v = f.pv;
+                /* Compute 1/2 m v^2 for all clusters in one pass over the atoms */
+                clust_kinetic_energy(masses, v, nindex, clust_index, clust_ekin.data(), clust_natoms.data());
                 if (max_clust_ind >= 0)
                 {
-                    ekin = 0;
-                    for (i = 0; (i < nindex); i++)
+                    temp = (clust_ekin[max_clust_ind] * 2.0)
+                           / (3.0 * tfac * clust_natoms[max_clust_ind] * gmx::c_boltz);
+                    fprintf(tp, "%10.3f  %10.3f\n", frameTime, temp);
+                }
+                if (tcp)
+                {
+                    for (ci = 0; (ci < nindex); ci++)
                     {
-                        if (clust_index[i] == max_clust_ind)
+                        if (clust_natoms[ci] > 0)
                         {
-                            ai     = index[i];
-                            double m = mtopGetAtomMass(mtop, ai, &molb);
-                            ekin += 0.5 * m * iprod(v[ai], v[ai]);
+                            temp = (clust_ekin[ci] * 2.0) / (3.0 * tfac * clust_natoms[ci] * gmx::c_boltz);
+                            fprintf(tcp, "%12.3f  %8d  %8d  %8d  %10.3f\n", frameTime, ci, clust_size[ci], clust_natoms[ci], temp);
                         }
                     }
-                    temp = (ekin * 2.0) / (3.0 * tfac * max_clust_size * gmx::c_boltz);
-                    fprintf(tp, "%10.3f  %10.3f\n", frameTime, temp);
                 }
             }
         }
-        fprintf(cndx, "%10.3f ", frameTime);
-        for (i = 0; (i < nindex); i++) fprintf(cndx, "%i ", clust_index[i]);
-        fprintf(cndx, "\n");
-
-        if((bOndx>1) && (bMol)) 
+        /* The memberships are written for the analysed frames only, so all outputs hold the same frames */
+        if (cndx && f.bAnalyse)
         {
-            int largest=bOndx;
-            /* index file per frame per size */
-            snew(clust_written, nindex);
-            for(int oligsize=2;oligsize<=largest;oligsize++) {
-                std::string ndx_name = "cs_" +std::to_string(oligsize) + "_" + std::to_string(nframe) + ".ndx";
-                fp = gmx_ffopen(ndx_name.c_str(), "w");
-                for (int i = 0; (i < nindex); i++)
-                {
-                    // this tells how large is the cluster to which each molecule belongs
-	            ci = clust_index[i];
-	            if(clust_written[ci]==1) continue;
-                    if(index_size[i] == oligsize) 
-                    {
-                        fprintf(fp, "[ clust %i ]\n", ci);
-                        for (int j : mols.block(i)) fprintf(fp, "%d\n", j+1);
-	                for(int j=i+1; (j < nindex); j++)
-	                {
-	                    if(clust_index[j]==ci) 
-	                    {
-                                for (int k : mols.block(j)) fprintf(fp, "%d\n", k+1);
-                            }
-	                }
-	                clust_written[ci]=1;
-	            }
-	        }
-                gmx_ffclose(fp);
-            }
-            sfree(clust_written);
+            fprintf(cndx, "%10.3f ", frameTime);
+            for (i = 0; (i < nindex); i++) fprintf(cndx, "%i ", clust_index[i]);
+            fprintf(cndx, "\n");
+        }
+        if (membw && f.bAnalyse)
+        {
+            write_membership_frame(membw, frameTime, clust_index);
+        }
+        if (olig && f.bAnalyse)
+        {
+            /* memberships of the oligomers from size 2 to bOndx */
+            olig_archive_frame(olig, nframe, frameTime, bOndx, nindex, clust_index, index_size, mols, &olig_table);
         }
 
+        if (nbuf == 1)
+        {
+            bMore = read_next_frame(oenv, status, &fr);
+        }
         nframe++;
-    } while (read_next_frame(oenv, status, &fr));
+    } while (b < nbatch || bMore);
     close_trx(status);
     done_frame(&fr);
     xvgrclose(fp);
     xvgrclose(gp);
     xvgrclose(hp);
     xvgrclose(tp);
-    xvgrclose(cndx); 
+    if (tcp)
+    {
+        gmx_ffclose(tcp);
+    }
+    if (cndx)
+    {
+        xvgrclose(cndx);
+    }
+    if (membw)
+    {
+        close_membership_writer(membw);
+    }
+    if (bTrack)
+    {
+        if (tracker.fp_ev)
+        {
+            gmx_ffclose(tracker.fp_ev);
+        }
+        clust_track_write(tracker, n_x > 1 ? (t_x[n_x - 1] - t_x[0]) / (n_x - 1) : 0, lifetime, avlifetime, oenv);
+    }
+    if (olig)
+    {
+        olig_archive_close(olig, olig_table);
+    }
 
     snew(clust_written, nindex);
     if (max_clust_ind >= 0)
@@ -565,124 +2098,767 @@ static void clust_size(const char*             ndx,
     fprintf(fp, "%5d  %8.3f\n", 0, 0.0);
     for (j = 0; (j < max_size); j++)
     {
-        double nelem = 0;
-        for (i = 0; (i < n_x); i++)
+        double nelem = cs_sum[j];
+        fprintf(fp, "%5d  %8.3f\n", j + 1, nelem / n_x);
+        nhisto += static_cast<int>((j + 1) * nelem / n_x);
+    }
+    fprintf(fp, "%5d  %8.3f\n", j + 1, 0.0);
+    xvgrclose(fp);
+
+    if (!cut_list.empty())
+    {
+        xvgrclose(ncp);
+        xvgrclose(mcp);
+        cut_hist.assign(cut_list.size() * nindex, 0.0);
+        for (const t_clust_work& w : work)
+        {
+            for (std::size_t n = 0; n < cut_hist.size(); n++)
+            {
+                cut_hist[n] += w.cut_hist[n];
+            }
+        }
+        fp = xvgropen(hcutf, "Cluster size distribution", "Cluster size", "()", oenv);
+        xvgrLegend(fp, cut_legend, oenv);
+        for (j = 0; (j <= cut_max_size + 1); j++)
+        {
+            fprintf(fp, "%5d", j);
+            for (std::size_t c = 0; c < cut_list.size(); c++)
+            {
+                double nelem = (j >= 1 && j <= cut_max_size) ? cut_hist[c * nindex + j - 1] : 0.0;
+                fprintf(fp, "  %8.3f", nelem / n_x);
+            }
+            fprintf(fp, "\n");
+        }
+        xvgrclose(fp);
+    }
+
+    fp = xvgropen(histotime, "Time Resolved distribution of oligomers order", timeLabel, "# of oligomers of order #", oenv);
+    for (i = 0; (i < n_x); i++)
+    {
+        fprintf(fp, "%14.6e ", t_x[i]);
+        k = cs_frame_start[i];
+    	for (j = 0; (j < max_size); j++)
+    	{
+            double nelem = 0;
+            if (k < cs_frame_start[i + 1] && cs_occ_size[k] == j + 1)
+            {
+                nelem = cs_occ_num[k++];
+            }
+        	fprintf(fp, " %8.3f", nelem);
+        }
+        fprintf(fp,"\n");
+    }
+    xvgrclose(fp); 
+
+    fp = xvgropen(trmatrix, "Transition Matrix", "Oligomers order", "Oligomers order", oenv);
+    /* The sum of the rows should be divisible for the oligomer order (that is the row number)\n");
+       Rows are transitions toward lower order oligomers\n");
+       Columns are transitions toward higher order oligomers\n"); */
+    for (i = 0; (i < nindex); i++)
+    {
+    	for (j = 0; (j < nindex); j++)
+    	{
+        	fprintf(fp, "%8.6lf ", order_matrix_get(tr_matrix, i, j)/norm_matrix[j]);
+        }
+        fprintf(fp,"\n");
+    }
+    xvgrclose(fp);
+ 
+    fp = xvgropen(kmatrix, "Rates Matrix in ps-1", "Oligomers order", "Oligomers order", oenv);
+    /* Rows are transitions toward lower order oligomers\n");
+       Columns are transitions toward higher order oligomers\n"); */
+    for (i = 0; (i < nindex); i++)
+    {
+    	for (j = 0; (j < nindex); j++)
+    	{
+        	fprintf(fp, "%8.6lf ", order_matrix_get(rate_matrix, i, j)/norm_matrix[j]/frameTimeStep);
+        }
+        fprintf(fp,"\n");
+    }
+    xvgrclose(fp);
+
+    fprintf(stderr, "Total number of atoms in clusters =  %d\n", nhisto);
+    if (bMol && skin > 0)
+    {
+        int nlistbuild = 0;
+        for (const t_clust_work& w : work)
+        {
+            nlistbuild += w.nlistbuild;
+        }
+        fprintf(stderr, "The pair list was built %d times for %d analysed frames\n", nlistbuild, n_x);
+    }
+
+    /* Look for the smallest entry that is not zero
+     * This will make that zero is white, and not zero is coloured.
+     */
+    cmid = 100.0;
+    cmax = 0.0;
+    for (std::size_t n = 0; n < cs_occ_num.size(); n++)
+    {
+        cmid = std::min<double>(cs_occ_num[n], cmid);
+        cmax = std::max<double>(cs_occ_num[n], cmax);
+    }
+    fprintf(stderr, "cmid: %g, cmax: %g, max_size: %d\n", cmid, cmax, max_size);
+    cmid = 1;
+    fp   = gmx_ffopen(xpm, "w");
+    gmx_ffclose(fp);
+    cmid = 100.0;
+    cmax = 0.0;
+    for (std::size_t n = 0; n < cs_occ_num.size(); n++)
+    {
+        double nw = static_cast<double>(cs_occ_num[n]) * cs_occ_size[n];
+        cmid      = std::min(nw, cmid);
+        cmax      = std::max(nw, cmax);
+    }
+    fprintf(stderr, "cmid: %g, cmax: %g, max_size: %d\n", cmid, cmax, max_size);
+    fp = gmx_ffopen(xpmw, "w");
+    gmx_ffclose(fp);
+    sfree(t_x);
+    sfree(t_y);
+    sfree(cs_cur);
+    sfree(cs_prev);
+    sfree(cs_sum);
+    sfree(cs_prefix);
+    sfree(norm_matrix);
+    sfree(norm_done);
+    sfree(clust_index);
+    sfree(clust_size);
+    sfree(xa_start);
+    sfree(index);
+}
+
+/* Precision of the accumulated -inter_mol density functions. Accumulating in float halves
+ * the memory traffic of the KDE updates, the normalization is always done in double.
+ */
+#ifndef GMX_CLUSTSIZE_DENSITY_FLOAT
+#    define GMX_CLUSTSIZE_DENSITY_FLOAT 0
+#endif
+#if GMX_CLUSTSIZE_DENSITY_FLOAT
+typedef float density_real;
+#else
+typedef double density_real;
+#endif
+
+/* Density functions of the atom pairs of a set of blocks (molecule types, or pairs of them)
+ * in a single contiguous buffer indexed [block][atom i][atom j][bin]. The bins of every atom
+ * pair start on a cache line, so that the KDE updates work on aligned contiguous memory.
+ * With bSym the blocks are symmetric and only the pairs i <= j are stored, packed by rows.
+ */
+struct t_density_tensor
+{
+    int                                                            nbin   = 0;
+    int                                                            stride = 0;
+    gmx_bool                                                       bSym   = FALSE;
+    std::vector<int>                                               nj;
+    std::vector<std::size_t>                                       offset;
+    std::vector<density_real, gmx::AlignedAllocator<density_real>> data;
+};
+
+/* Set up t for blocks of ni[b] x nj[b] atom pairs of nbin bins, all zero. With bSym
+ * ni[b] == nj[b] and only the ni[b] (ni[b] + 1) / 2 pairs i <= j are stored.
+ */
+static void density_tensor_init(t_density_tensor*       t,
+                                const std::vector<int>& ni,
+                                const std::vector<int>& nj,
+                                int                     nbin,
+                                gmx_bool                bSym = FALSE)
+{
+    const int c_rowAlign = 64 / sizeof(density_real);
+
+    t->nbin   = nbin;
+    t->stride = ((nbin + c_rowAlign - 1) / c_rowAlign) * c_rowAlign;
+    t->bSym   = bSym;
+    t->nj     = nj;
+    t->offset.resize(ni.size() + 1);
+    t->offset[0] = 0;
+    for (std::size_t b = 0; b < ni.size(); b++)
+    {
+        const std::size_t npair = bSym ? static_cast<std::size_t>(ni[b]) * (ni[b] + 1) / 2
+                                       : static_cast<std::size_t>(ni[b]) * nj[b];
+        t->offset[b + 1] = t->offset[b] + npair * t->stride;
+    }
+    t->data.assign(t->offset.back(), 0);
+}
+
+/* Offset in t->data of the bins of the atom pair i, j of block b, with bSym i <= j */
+static inline std::size_t density_tensor_offset(const t_density_tensor& t, int b, int i, int j)
+{
+    const std::size_t ii = i;
+    const std::size_t pair = t.bSym ? ii * t.nj[b] - ii * (ii - 1) / 2 + (j - i) : ii * t.nj[b] + j;
+    return t.offset[b] + pair * t.stride;
+}
+
+/* The bins of the atom pair i, j of block b */
+static inline density_real* density_tensor_row(t_density_tensor* t, int b, int i, int j)
+{
+    return t->data.data() + density_tensor_offset(*t, b, i, j);
+}
+
+/* The bins of the atom pair i, j of block b multiplied by norm, in double */
+static void density_tensor_get(const t_density_tensor& t, int b, int i, int j, double norm, std::vector<double>* v)
+{
+    const density_real* row = t.data.data() + density_tensor_offset(t, b, i, j);
+    v->resize(t.nbin);
+    for (int k = 0; k < t.nbin; k++)
+    {
+        (*v)[k] = row[k] * norm;
+    }
+}
+
+/* Add the density functions of s to those of t, which has the same layout */
+static void density_tensor_add(t_density_tensor* t, const t_density_tensor& s, int nthreads)
+{
+    const std::ptrdiff_t n = t->data.size();
+    density_real*        a = t->data.data();
+    const density_real*  b = s.data.data();
+#pragma omp parallel for num_threads(nthreads) schedule(static)
+    for (std::ptrdiff_t k = 0; k < n; k++)
+    {
+        a[k] += b[k];
+    }
+}
+
+/* Heavy (non-hydrogen) atoms of the molecules for -inter_mol, resolved once from the topology:
+ * per molecule their local and global indices and every frame their coordinates in x/y/z arrays.
+ * bTemplate tells whether a molecule has the same heavy atoms as the first one of its type.
+ */
+struct t_heavy_atoms
+{
+    std::vector<int>  start;
+    std::vector<int>  local;
+    std::vector<int>  atom;
+    std::vector<bool> bTemplate;
+    std::vector<real> x, y, z;
+};
+
+static void heavy_atoms_init(t_heavy_atoms*                ha,
+                             const gmx_mtop_t&             mtop,
+                             const gmx::RangePartitioning& mols,
+                             int                           nindex,
+                             const std::vector<int>&       mol_id,
+                             int                           ntype)
+{
+    int                           molb = 0;
+    const char*                   atomname;
+    std::vector<int>              local;
+    std::vector<std::vector<int>> first(ntype);
+    std::vector<bool>             bSet(ntype, false);
+
+    ha->start.assign(1, 0);
+    ha->local.clear();
+    ha->atom.clear();
+    ha->bTemplate.resize(nindex);
+    for (int i = 0; i < nindex; i++)
+    {
+        local.clear();
+        for (int a : mols.block(i))
+        {
+            mtopGetAtomAndResidueName(mtop, a, &molb, &atomname, nullptr, nullptr, nullptr);
+            if (atomname[0] != 'H')
+            {
+                local.push_back(a - *mols.block(i).begin());
+            }
+        }
+        if (!bSet[mol_id[i]])
+        {
+            first[mol_id[i]] = local;
+            bSet[mol_id[i]]  = true;
+        }
+        ha->bTemplate[i] = (local == first[mol_id[i]]);
+        for (int p : local)
+        {
+            ha->local.push_back(p);
+            ha->atom.push_back(*mols.block(i).begin() + p);
+        }
+        ha->start.push_back(ha->atom.size());
+    }
+    ha->x.resize(ha->atom.size());
+    ha->y.resize(ha->atom.size());
+    ha->z.resize(ha->atom.size());
+}
+
+static void heavy_atoms_gather(t_heavy_atoms* ha, const rvec x[])
+{
+    for (std::size_t p = 0; p < ha->atom.size(); p++)
+    {
+        ha->x[p] = x[ha->atom[p]][XX];
+        ha->y[p] = x[ha->atom[p]][YY];
+        ha->z[p] = x[ha->atom[p]][ZZ];
+    }
+}
+
+/* Distances squared d2[p*nj + q] between the heavy atoms p of molecule i and q of molecule j.
+ * Without PBC (pbc is nullptr) or with a rectangular box the minimum image is taken without
+ * branches, so that the inner loop vectorizes, other boxes use pbc_dx on x.
+ */
+static void heavy_atoms_dist2(const t_heavy_atoms& ha, int i, int j, const rvec x[], const t_pbc* pbc, real d2[])
+{
+    const int bi = ha.start[i];
+    const int ni = ha.start[i + 1] - bi;
+    const int bj = ha.start[j];
+    const int nj = ha.start[j + 1] - bj;
+
+    if (pbc
+        && (pbc->pbcType != PbcType::Xyz || pbc->box[YY][XX] != 0 || pbc->box[ZZ][XX] != 0
+            || pbc->box[ZZ][YY] != 0))
+    {
+        rvec dx;
+        for (int p = 0; p < ni; p++)
+        {
+            for (int q = 0; q < nj; q++)
+            {
+                pbc_dx(pbc, x[ha.atom[bi + p]], x[ha.atom[bj + q]], dx);
+                d2[p * nj + q] = iprod(dx, dx);
+            }
+        }
+        return;
+    }
+
+    const real  bx  = pbc ? pbc->box[XX][XX] : 0;
+    const real  by  = pbc ? pbc->box[YY][YY] : 0;
+    const real  bz  = pbc ? pbc->box[ZZ][ZZ] : 0;
+    const real  ibx = pbc ? 1 / bx : 0;
+    const real  iby = pbc ? 1 / by : 0;
+    const real  ibz = pbc ? 1 / bz : 0;
+    const real* xj  = ha.x.data() + bj;
+    const real* yj  = ha.y.data() + bj;
+    const real* zj  = ha.z.data() + bj;
+    for (int p = 0; p < ni; p++)
+    {
+        const real xi  = ha.x[bi + p];
+        const real yi  = ha.y[bi + p];
+        const real zi  = ha.z[bi + p];
+        real*      d2p = d2 + p * nj;
+        for (int q = 0; q < nj; q++)
         {
-            nelem += cs_dist[i][j];
+            real dx = xi - xj[q];
+            real dy = yi - yj[q];
+            real dz = zi - zj[q];
+            dx -= bx * std::floor(dx * ibx + real(0.5));
+            dy -= by * std::floor(dy * iby + real(0.5));
+            dz -= bz * std::floor(dz * ibz + real(0.5));
+            d2p[q] = dx * dx + dy * dy + dz * dz;
         }
-        fprintf(fp, "%5d  %8.3f\n", j + 1, nelem / n_x);
-        nhisto += static_cast<int>((j + 1) * nelem / n_x);
     }
-    fprintf(fp, "%5d  %8.3f\n", j + 1, 0.0);
-    xvgrclose(fp);
+}
 
-    fp = xvgropen(histotime, "Time Resolved distribution of oligomers order", timeLabel, "# of oligomers of order #", oenv);
-    for (i = 0; (i < n_x); i++)
+/* Shortest distance squared found for the atom pairs of a molecule and its neighbours.
+ * The buffer is reused for all molecules: entries are only reset when they were set,
+ * and those are listed, so no allocation or full clearing is needed per molecule.
+ */
+struct t_pair_mindist
+{
+    int                 nj = 0;
+    std::vector<double> d2;
+    std::vector<int>    set;
+};
+
+/* Distance squared of a pair that was not found */
+static const double c_pairNoDist = 100.;
+
+/* Set up m for up to nimax x njmax atom pairs */
+static void pair_mindist_init(t_pair_mindist* m, int nimax, int njmax)
+{
+    m->nj = njmax;
+    m->d2.assign(static_cast<std::size_t>(nimax) * njmax, c_pairNoDist);
+    m->set.clear();
+}
+
+/* Start a molecule with nj atoms in the second dimension, all entries should be reset */
+static inline void pair_mindist_begin(t_pair_mindist* m, int nj)
+{
+    GMX_ASSERT(m->set.empty(), "Pair distances should be reset before reuse");
+    m->nj = nj;
+}
+
+static inline void pair_mindist_add(t_pair_mindist* m, int k, double d2)
+{
+    if (d2 < m->d2[k])
     {
-        fprintf(fp, "%14.6e ", t_x[i]);
-    	for (j = 0; (j < max_size); j++)
-    	{
-        	fprintf(fp, " %8.3f", cs_dist[i][j]);
+        if (m->d2[k] == c_pairNoDist)
+        {
+            m->set.push_back(k);
         }
-        fprintf(fp,"\n");
+        m->d2[k] = d2;
     }
-    xvgrclose(fp); 
+}
 
-    fp = xvgropen(trmatrix, "Transition Matrix", "Oligomers order", "Oligomers order", oenv);
-    /* The sum of the rows should be divisible for the oligomer order (that is the row number)\n");
-       Rows are transitions toward lower order oligomers\n");
-       Columns are transitions toward higher order oligomers\n"); */
-    for (i = 0; (i < nindex); i++)
+static inline void pair_mindist_add(t_pair_mindist* m, int i, int j, double d2)
+{
+    pair_mindist_add(m, i * m->nj + j, d2);
+}
+
+static inline void pair_mindist_reset(t_pair_mindist* m)
+{
+    for (int k : m->set)
     {
-    	for (j = 0; (j < nindex); j++)
-    	{
-        	fprintf(fp, "%8.6lf ", tr_matrix[i][j]/norm_matrix[j]);
-        }
-        fprintf(fp,"\n");
+        m->d2[k] = c_pairNoDist;
     }
-    xvgrclose(fp);
- 
-    fp = xvgropen(kmatrix, "Rates Matrix in ps-1", "Oligomers order", "Oligomers order", oenv);
-    /* Rows are transitions toward lower order oligomers\n");
-       Columns are transitions toward higher order oligomers\n"); */
-    for (i = 0; (i < nindex); i++)
+    m->set.clear();
+}
+
+/* Contact of the atom pair k = a_i*nat + a_j between two molecules of the same type */
+struct t_mol_contact
+{
+    int  k;
+    real d2;
+};
+
+/* Contacts [begin, end) in the list of molecule mol */
+struct t_contact_span
+{
+    int mol;
+    int begin;
+    int end;
+};
+
+/* Work space of a thread for -inter_mol: the shortest distances of the pairs of its current
+ * molecule and the density functions it accumulates, which are summed over the threads at the end
+ */
+struct t_interm_work
+{
+    t_pair_mindist              same_mdist;
+    t_pair_mindist              intra_mdist;
+    std::vector<t_pair_mindist> cross_mdist;
+    std::vector<real>           pair_d2;
+    t_density_tensor            same_density;
+    t_density_tensor            intra_density;
+    t_density_tensor            cross_density;
+};
+
+/* State of an -inter_mol run, written with -imstate: the density functions before the
+ * normalisation by the number of analysed frames, so that the runs over parts of a trajectory
+ * can be summed with -immerge and an interrupted run can be continued with -imresume.
+ * After the magic string there are:
+ *   the size of density_real (int32), the number of molecule types (int32) and for each type
+ *   the number of atoms and of molecules (int32 pairs), the number of bins (int32),
+ *   cut, mol_cut and kde_h (double), PBC and mass center (int32),
+ *   the number of frames read and analysed (int64), the time of the last frame read (double),
+ *   and the same type, intra and cross tensors, each as its length (int64) and its values,
+ *   the same type and intra ones only for the atom pairs ii <= jj.
+ * The file ends with the magic string again. Values are stored with the native byte order.
+ */
+static const char c_intermMagic[8] = { 'C', 'S', 'I', 'M', 'A', 'T', '0', '2' };
+
+struct t_interm_state
+{
+    std::vector<int32_t> natmol;
+    std::vector<int32_t> nummol;
+    int32_t              nbin        = 0;
+    double               cut         = 0;
+    double               mol_cut     = 0;
+    double               kde_h       = 0;
+    int32_t              bPBC        = 0;
+    int32_t              bMassCenter = 0;
+    int64_t              nframe      = 0;
+    int64_t              n_x         = 0;
+    double               time        = 0;
+};
+
+static void interm_fwrite(const void* ptr, std::size_t size, std::size_t n, FILE* fp)
+{
+    if (fwrite(ptr, size, n, fp) != n)
     {
-    	for (j = 0; (j < nindex); j++)
-    	{
-        	fprintf(fp, "%8.6lf ", rate_matrix[i][j]/norm_matrix[j]/frameTimeStep);
-        }
-        fprintf(fp,"\n");
+        gmx_fatal(FARGS, "Could not write the -inter_mol output");
     }
-    xvgrclose(fp);
+}
 
-    fprintf(stderr, "Total number of atoms in clusters =  %d\n", nhisto);
+static void interm_fread(void* ptr, std::size_t size, std::size_t n, FILE* fp, const char* fn)
+{
+    if (fread(ptr, size, n, fp) != n)
+    {
+        gmx_fatal(FARGS, "-inter_mol file %s is truncated or corrupted", fn);
+    }
+}
 
-    /* Look for the smallest entry that is not zero
-     * This will make that zero is white, and not zero is coloured.
-     */
-    cmid = 100.0;
-    cmax = 0.0;
-    for (i = 0; (i < n_x); i++)
+/* Write the state to fn, through a temporary file so that fn stays complete when a
+ * checkpoint is interrupted.
+ */
+static void interm_state_write(const char*             fn,
+                               const t_interm_state&   s,
+                               const t_density_tensor& same,
+                               const t_density_tensor& intra,
+                               const t_density_tensor& cross)
+{
+    std::string tmp = std::string(fn) + ".tmp";
+    FILE*       fp  = gmx_ffopen(tmp, "wb");
+    int32_t     head[2] = { static_cast<int32_t>(sizeof(density_real)), static_cast<int32_t>(s.natmol.size()) };
+    interm_fwrite(c_intermMagic, 1, sizeof(c_intermMagic), fp);
+    interm_fwrite(head, sizeof(int32_t), 2, fp);
+    for (std::size_t t = 0; t < s.natmol.size(); t++)
+    {
+        int32_t type[2] = { s.natmol[t], s.nummol[t] };
+        interm_fwrite(type, sizeof(int32_t), 2, fp);
+    }
+    double  settings[3] = { s.cut, s.mol_cut, s.kde_h };
+    int32_t flags[2]    = { s.bPBC, s.bMassCenter };
+    int64_t frames[2]   = { s.nframe, s.n_x };
+    interm_fwrite(&s.nbin, sizeof(s.nbin), 1, fp);
+    interm_fwrite(settings, sizeof(double), 3, fp);
+    interm_fwrite(flags, sizeof(int32_t), 2, fp);
+    interm_fwrite(frames, sizeof(int64_t), 2, fp);
+    interm_fwrite(&s.time, sizeof(s.time), 1, fp);
+    for (const t_density_tensor* t : { &same, &intra, &cross })
+    {
+        int64_t n = t->data.size();
+        interm_fwrite(&n, sizeof(n), 1, fp);
+        interm_fwrite(t->data.data(), sizeof(density_real), n, fp);
+    }
+    interm_fwrite(c_intermMagic, 1, sizeof(c_intermMagic), fp);
+    gmx_ffclose(fp);
+    if (gmx_file_rename(tmp.c_str(), fn) != 0)
+    {
+        gmx_fatal(FARGS, "Could not rename %s to %s", tmp.c_str(), fn);
+    }
+}
+
+/* Read the state fn, which should have the settings of s, add its density functions to
+ * the tensors and return its frame counts and time in s.
+ */
+static void interm_state_read(const char*       fn,
+                              t_interm_state*   s,
+                              t_density_tensor* same,
+                              t_density_tensor* intra,
+                              t_density_tensor* cross)
+{
+    char           magic[sizeof(c_intermMagic)];
+    int32_t        head[2];
+    t_interm_state r;
+
+    FILE* fp = gmx_ffopen(fn, "rb");
+    interm_fread(magic, 1, sizeof(magic), fp, fn);
+    if (!std::equal(magic, magic + sizeof(magic), c_intermMagic))
+    {
+        gmx_fatal(FARGS, "%s is not an -inter_mol state written by gmx clustsize", fn);
+    }
+    interm_fread(head, sizeof(int32_t), 2, fp, fn);
+    if (head[0] != static_cast<int32_t>(sizeof(density_real)))
+    {
+        gmx_fatal(FARGS, "-inter_mol state %s was written with a different precision of the density functions", fn);
+    }
+    r.natmol.resize(head[1]);
+    r.nummol.resize(head[1]);
+    for (int t = 0; t < head[1]; t++)
+    {
+        int32_t type[2];
+        interm_fread(type, sizeof(int32_t), 2, fp, fn);
+        r.natmol[t] = type[0];
+        r.nummol[t] = type[1];
+    }
+    double  settings[3];
+    int32_t flags[2];
+    int64_t frames[2];
+    interm_fread(&r.nbin, sizeof(r.nbin), 1, fp, fn);
+    interm_fread(settings, sizeof(double), 3, fp, fn);
+    interm_fread(flags, sizeof(int32_t), 2, fp, fn);
+    interm_fread(frames, sizeof(int64_t), 2, fp, fn);
+    interm_fread(&r.time, sizeof(r.time), 1, fp, fn);
+    if (r.natmol != s->natmol || r.nummol != s->nummol)
+    {
+        gmx_fatal(FARGS, "-inter_mol state %s was written for different molecules", fn);
+    }
+    if (r.nbin != s->nbin || settings[0] != s->cut || settings[1] != s->mol_cut
+        || settings[2] != s->kde_h || flags[0] != s->bPBC || flags[1] != s->bMassCenter)
     {
-        for (j = 0; (j < max_size); j++)
+        gmx_fatal(FARGS,
+                  "-inter_mol state %s was written with different settings (-cut, -mol_cut, "
+                  "-kde_h, -pbc or -mol_com)",
+                  fn);
+    }
+    std::vector<density_real> buf;
+    for (t_density_tensor* t : { same, intra, cross })
+    {
+        int64_t n;
+        interm_fread(&n, sizeof(n), 1, fp, fn);
+        if (n != static_cast<int64_t>(t->data.size()))
         {
-            if ((cs_dist[i][j] > 0) && (cs_dist[i][j] < cmid))
-            {
-                cmid = cs_dist[i][j];
-            }
-            cmax = std::max(cs_dist[i][j], cmax);
+            gmx_fatal(FARGS, "-inter_mol state %s is truncated or corrupted", fn);
+        }
+        buf.resize(n);
+        interm_fread(buf.data(), sizeof(density_real), n, fp, fn);
+        for (int64_t k = 0; k < n; k++)
+        {
+            t->data[k] += buf[k];
         }
     }
-    fprintf(stderr, "cmid: %g, cmax: %g, max_size: %d\n", cmid, cmax, max_size);
-    cmid = 1;
-    fp   = gmx_ffopen(xpm, "w");
+    interm_fread(magic, 1, sizeof(magic), fp, fn);
+    if (!std::equal(magic, magic + sizeof(magic), c_intermMagic))
+    {
+        gmx_fatal(FARGS, "-inter_mol state %s is truncated or corrupted", fn);
+    }
     gmx_ffclose(fp);
-    cmid = 100.0;
-    cmax = 0.0;
-    for (i = 0; (i < n_x); i++)
+    s->nframe = frames[0];
+    s->n_x    = frames[1];
+    s->time   = r.time;
+}
+
+/* Archive with the normalised distance density functions written with -histo. After the
+ * magic string there are the number of bins (int32), the number of molecule types (int32),
+ * the number of atoms of each type (int32) and the centers of the bins (double).
+ * Then follow the blocks of the molecule type pairs i <= j, the inter-molecular ones and
+ * for i == j also the intra-molecular ones, each with the densities (double) of all atom
+ * pairs ii, jj indexed [ii][jj][bin]. The file ends with the table of the blocks,
+ * kind (0 inter, 1 intra), i and j (int64) and offset (int64) for every block, the offset
+ * of the table (int64) and the magic string again.
+ * Values are stored with the native byte order.
+ */
+static const char c_histoMagic[8] = { 'C', 'S', 'I', 'M', 'H', 'I', '0', '1' };
+
+static void interm_histo_write(const char*                          fn,
+                               const std::vector<int>&              natmol,
+                               const std::vector<double>&           bins,
+                               const std::vector<std::vector<int>>& cross_index,
+                               const t_density_tensor&              same,
+                               const t_density_tensor&              intra,
+                               const t_density_tensor&              cross,
+                               double                               norm)
+{
+    FILE*                fp      = gmx_ffopen(fn, "wb");
+    int32_t              head[2] = { static_cast<int32_t>(bins.size()), static_cast<int32_t>(natmol.size()) };
+    std::vector<int32_t> nat(natmol.begin(), natmol.end());
+    std::vector<int64_t> table;
+    std::vector<double>  row;
+    interm_fwrite(c_histoMagic, 1, sizeof(c_histoMagic), fp);
+    interm_fwrite(head, sizeof(int32_t), 2, fp);
+    interm_fwrite(nat.data(), sizeof(int32_t), nat.size(), fp);
+    interm_fwrite(bins.data(), sizeof(double), bins.size(), fp);
+    for (std::size_t i = 0; i < natmol.size(); i++)
     {
-        for (j = 0; (j < max_size); j++)
+        for (std::size_t j = i; j < natmol.size(); j++)
         {
-            cs_dist[i][j] *= (j + 1);
-            if ((cs_dist[i][j] > 0) && (cs_dist[i][j] < cmid))
+            for (int kind = 0; kind < (i == j ? 2 : 1); kind++)
             {
-                cmid = cs_dist[i][j];
+                table.push_back(kind);
+                table.push_back(i);
+                table.push_back(j);
+                table.push_back(gmx_ftell(fp));
+                for (int ii = 0; ii < natmol[i]; ii++)
+                {
+                    for (int jj = 0; jj < natmol[j]; jj++)
+                    {
+                        /* only ii <= jj is stored for the same molecule type */
+                        if (i != j)
+                        {
+                            density_tensor_get(cross, cross_index[i][j], ii, jj, norm, &row);
+                        }
+                        else
+                        {
+                            density_tensor_get(kind == 0 ? same : intra, i, std::min(ii, jj), std::max(ii, jj), norm, &row);
+                        }
+                        interm_fwrite(row.data(), sizeof(double), row.size(), fp);
+                    }
+                }
             }
-            cmax = std::max(cs_dist[i][j], cmax);
         }
     }
-    fprintf(stderr, "cmid: %g, cmax: %g, max_size: %d\n", cmid, cmax, max_size);
-    fp = gmx_ffopen(xpmw, "w");
+    int64_t offset = gmx_ftell(fp);
+    interm_fwrite(table.data(), sizeof(int64_t), table.size(), fp);
+    interm_fwrite(&offset, sizeof(offset), 1, fp);
+    interm_fwrite(c_histoMagic, 1, sizeof(c_histoMagic), fp);
     gmx_ffclose(fp);
-    sfree(t_x);
-    sfree(t_y);
-    for (i = 0; (i < n_x); i++)
+}
+
+/* Write the density functions of the archive fn as text, one inter_mol_i_j_aa_ii.dat or
+ * intra_mol_i_i_aa_ii.dat file per atom ii of molecule type i, with the bin centers in the first
+ * column and the atoms jj of molecule type j in the others.
+ */
+static void interm_histo_extract(const char* fn)
+{
+    char    magic[sizeof(c_histoMagic)];
+    int32_t head[2];
+    int64_t offset = 0;
+
+    FILE* fp = gmx_ffopen(fn, "rb");
+    interm_fread(magic, 1, sizeof(magic), fp, fn);
+    if (!std::equal(magic, magic + sizeof(magic), c_histoMagic))
     {
-        sfree(cs_dist[i]);
+        gmx_fatal(FARGS, "%s is not an -inter_mol histogram archive written by gmx clustsize", fn);
     }
-    sfree(cs_dist);
-    sfree(clust_index);
-    sfree(clust_size);
-    sfree(index);
+    interm_fread(head, sizeof(int32_t), 2, fp, fn);
+    std::vector<int32_t> natmol(head[1]);
+    std::vector<double>  bins(head[0]);
+    interm_fread(natmol.data(), sizeof(int32_t), natmol.size(), fp, fn);
+    interm_fread(bins.data(), sizeof(double), bins.size(), fp, fn);
+
+    gmx_fseek(fp, -static_cast<gmx_off_t>(sizeof(offset) + sizeof(magic)), SEEK_END);
+    int64_t end = gmx_ftell(fp);
+    interm_fread(&offset, sizeof(offset), 1, fp, fn);
+    interm_fread(magic, 1, sizeof(magic), fp, fn);
+    if (!std::equal(magic, magic + sizeof(magic), c_histoMagic))
+    {
+        gmx_fatal(FARGS, "-inter_mol histogram archive %s is incomplete, the run did not finish", fn);
+    }
+    std::vector<int64_t> table((end - offset) / sizeof(int64_t));
+    gmx_fseek(fp, offset, SEEK_SET);
+    interm_fread(table.data(), sizeof(int64_t), table.size(), fp, fn);
+
+    std::vector<double> block;
+    for (std::size_t t = 0; t + 3 < table.size(); t += 4)
+    {
+        const int i = table[t + 1];
+        const int j = table[t + 2];
+        block.resize(static_cast<std::size_t>(natmol[j]) * bins.size());
+        gmx_fseek(fp, table[t + 3], SEEK_SET);
+        for (int ii = 0; ii < natmol[i]; ii++)
+        {
+            interm_fread(block.data(), sizeof(double), block.size(), fp, fn);
+            std::string name = gmx::formatString("%s_mol_%d_%d_aa_%d.dat", table[t] == 0 ? "inter" : "intra", i + 1, j + 1, ii + 1);
+            FILE*       out  = gmx_ffopen(name, "w");
+            for (std::size_t k = 0; k < bins.size(); k++)
+            {
+                fprintf(out, "%lf", bins[k]);
+                for (int jj = 0; jj < natmol[j]; jj++)
+                {
+                    fprintf(out, " %lf", block[jj * bins.size() + k]);
+                }
+                fprintf(out, "\n");
+            }
+            gmx_ffclose(out);
+        }
+    }
+    gmx_ffclose(fp);
+}
+
+/* Gaussian kernel of bandwidth h, truncated at 2h and shifted to zero there, on the uniform
+ * bins dx*(i+0.5) of the density functions. The constants are computed once by kde_init.
+ */
+struct t_kde
+{
+    int    nbin;
+    double dx;
+    double h;
+    double scale;
+    double shift;
+    double decay;
+};
+
+static void kde_init(t_kde* kde, double cut, int nbin, double h)
+{
+    kde->nbin  = nbin;
+    kde->dx    = cut / nbin;
+    kde->h     = h;
+    kde->scale = 1. / (0.73853587 * h * std::sqrt(2. * M_PI));
+    kde->shift = std::exp(-2.);
+    kde->decay = std::exp(-gmx::square(kde->dx / h));
 }
 
-static inline void kernel_density_estimator(std::vector<double> &x, const std::vector<double> &bins, const double mu, const double norm) {
-    double h = 0.01;
-    double from_x = std::max(mu - 2 * h, bins[0]);
-    double to_x = std::min(mu + 2 * h, bins.back());
-    auto is_geq_start = [&from_x](double i){ return i >= from_x; };
-    auto is_geq_end = [&to_x](double i){ return i > to_x; };
-    auto start = std::find_if(bins.begin(), bins.end(), is_geq_start);
-    auto end = std::find_if(bins.begin(), bins.end(), is_geq_end);
-    int from = std::distance(bins.begin(), start);
-    int to = std::distance(bins.begin(), end);
-    double scale = norm/(0.73853587* h * std::sqrt(2.*M_PI));
-    if(mu<h) scale *= 2.;
-    double shift = std::exp(-2.);
+static inline void kernel_density_estimator(density_real x[], const t_kde &kde, const double mu, const double norm) {
+    // bins within mu +/- 2h
+    int from = std::max(0, static_cast<int>(std::ceil((mu - 2 * kde.h) / kde.dx - 0.5)));
+    int to = std::min(kde.nbin, static_cast<int>(std::floor((mu + 2 * kde.h) / kde.dx - 0.5)) + 1);
+    if(from >= to) return;
+    double scale = norm*kde.scale;
+    if(mu<kde.h) scale *= 2.;
+    // exp(-f^2/2) with f = (mu - bin)/h decreasing by d = dx/h from bin to bin:
+    // the ratio of neighbouring kernel values is exp(f*d - d^2/2), which itself changes by exp(-d^2)
+    double d = kde.dx/kde.h;
+    double f = (mu - kde.dx*(from + 0.5))/kde.h;
+    double kernel = std::exp(-0.5*f*f);
+    double ratio = std::exp(f*d - 0.5*d*d);
     for (int i = from; i < to; i++) {
-        double f=(mu-bins[i])/h;
-        double kernel = std::exp(-0.5*f*f);
-        x[i] += scale*(kernel-shift);
+        x[i] += scale*(kernel-kde.shift);
+        kernel *= ratio;
+        ratio *= kde.decay;
     }
 }
 
@@ -725,19 +2901,28 @@ static void do_interm_mat(const char*             trx,
                           const char*             outfile_inter,
                           const char*             outfile_intra,
                           gmx_bool                bPBC,
+                          gmx_bool                bMassCenter,
                           const char*             tpr,
                           double                  cut,
                           double                  mol_cut,
+                          double                  kde_h,
                           int                     nskip,
                           int                     skip_last_nmol,
-                          gmx_bool                write_histo,
+                          const char*             histo_out,
+                          int                     nthreads,
+                          const char*             state_out,
+                          const char*             state_in,
+                          gmx::ArrayRef<const std::string> merge,
+                          int                     nckpt,
                           const gmx_output_env_t* oenv)
 {
     t_trxframe    fr;
     clear_trxframe(&fr, TRUE);
 
-    t_trxstatus* status;
-    if (!read_first_frame(oenv, &status, trx, &fr, TRX_NEED_X | TRX_READ_V))
+    // with -immerge the density functions are only read from the states of previous runs
+    const bool bTraj = merge.empty();
+    t_trxstatus* status = nullptr;
+    if (bTraj && !read_first_frame(oenv, &status, trx, &fr, TRX_NEED_X | TRX_READ_V))
     {
         gmx_file(trx);
     }
@@ -751,7 +2936,7 @@ static void do_interm_mat(const char*             trx,
     if (tpr)
     {
         tpxh = readTpxHeader(tpr, true);
-        if (tpxh.natoms != natoms)
+        if (bTraj && tpxh.natoms != natoms)
         {
             gmx_fatal(FARGS, "tpr (%d atoms) and trajectory (%d atoms) do not match!", tpxh.natoms, natoms);
         }
@@ -805,22 +2990,21 @@ static void do_interm_mat(const char*             trx,
     //for(unsigned i=0; i<nindex;i++) printf("start_idnex %u %u\n", i, start_index[i]);
     //for(unsigned i=0; i<nindex;i++) printf("invnummol %u %lf\n", i, inv_num_mol[i]);
 
-    // Tensor atm x atm x nbins to accumulate density function
-    std::vector<std::vector<std::vector<std::vector<double> > > > interm_same_mat_density(natmol2.size());
-    std::vector<std::vector<std::vector<std::vector<double> > > > interm_cross_mat_density((natmol2.size()*(natmol2.size()-1))/2);
-    std::vector<std::vector<std::vector<std::vector<double> > > > intram_mat_density(natmol2.size());
-
     std::vector<double> density_bins(n_bins(cut, NBINS));
     for (int i = 0; i < density_bins.size(); i++ ) density_bins[i] = cut/static_cast<double>(density_bins.size())*static_cast<double>(i)+cut/static_cast<double>(density_bins.size()*2);
+    t_kde kde;
+    kde_init(&kde, cut, density_bins.size(), kde_h);
 
+    // Tensors molecule type (pair) x atm x atm x nbins to accumulate density function
+    // only the pairs ii <= jj are stored for the same molecule type
     int cross_count=0;
     std::vector<std::vector<int> > cross_index(natmol2.size(), std::vector<int>(natmol2.size(),0));
+    std::vector<int> cross_ni, cross_nj;
     for(std::size_t i=0; i<natmol2.size();i++) {
-      interm_same_mat_density[i].resize(natmol2[i], std::vector<std::vector<double>>(natmol2[i], std::vector<double>(n_bins(cut, NBINS),0)));
-      intram_mat_density[i].resize(natmol2[i], std::vector<std::vector<double>>(natmol2[i], std::vector<double>(n_bins(cut, NBINS),0)));
       for(std::size_t j=i+1; j<natmol2.size();j++) {
-        interm_cross_mat_density[i].resize(natmol2[i], std::vector<std::vector<double>>(natmol2[j], std::vector<double>(n_bins(cut, NBINS),0)));
         cross_index[i][j]=cross_count;
+        cross_ni.push_back(natmol2[i]);
+        cross_nj.push_back(natmol2[j]);
         cross_count++;
       }
     } 
@@ -828,6 +3012,32 @@ static void do_interm_mat(const char*             trx,
     // vector of center of masses
     rvec *xcm = nullptr;
     snew(xcm, nindex);
+    std::vector<int> mol_index(nindex);
+    std::iota(mol_index.begin(), mol_index.end(), 0);
+    t_mol_centers centers;
+    mol_centers_init(&centers, mols, nindex, mol_index.data(), &mtop, bMassCenter);
+
+    // every thread has the shortest distances of the atom pairs of its current molecule, reused for all molecules,
+    // the distances between the heavy atoms of a pair of molecules and its own density functions
+    int natmax = *std::max_element(natmol2.begin(), natmol2.end());
+    std::vector<t_interm_work> work(nthreads);
+    for(t_interm_work &w : work) {
+      pair_mindist_init(&w.same_mdist, natmax, natmax);
+      pair_mindist_init(&w.intra_mdist, natmax, natmax);
+      w.cross_mdist.resize(cross_count);
+      for(int c=0; c<cross_count; c++) pair_mindist_init(&w.cross_mdist[c], cross_ni[c], cross_nj[c]);
+      w.pair_d2.resize(static_cast<std::size_t>(natmax) * natmax);
+      density_tensor_init(&w.same_density, natmol2, natmol2, density_bins.size(), TRUE);
+      density_tensor_init(&w.intra_density, natmol2, natmol2, density_bins.size(), TRUE);
+      density_tensor_init(&w.cross_density, cross_ni, cross_nj, density_bins.size());
+    }
+
+    // heavy atoms of every molecule type
+    t_heavy_atoms heavy;
+    heavy_atoms_init(&heavy, mtop, mols, nindex, mol_id, natmol2.size());
+    // contacts of the pairs of molecules of the same type, per frame
+    std::vector<std::vector<t_mol_contact>> same_contacts(nindex);
+    std::vector<std::vector<t_contact_span>> same_pairs(nindex), same_spans(nindex);
 
     double mcut2 = mol_cut*mol_cut;
     double cut_sig_2 = (cut + 0.02) * (cut + 0.02);
@@ -836,52 +3046,136 @@ static void do_interm_mat(const char*             trx,
     // number of analysed frames
     int n_x = 0;
 
+    // settings and frame counts of the state, those of previous runs should match
+    t_interm_state state;
+    state.natmol.assign(natmol2.begin(), natmol2.end());
+    state.nummol.assign(num_mol.begin(), num_mol.end());
+    state.nbin = density_bins.size();
+    state.cut = cut;
+    state.mol_cut = mol_cut;
+    state.kde_h = kde_h;
+    state.bPBC = bPBC;
+    state.bMassCenter = bMassCenter;
+    // sums the density functions of the threads into those of the first thread
+    auto reduce_work = [&work, nthreads]() {
+      for(int t=1; t<nthreads; t++) {
+        density_tensor_add(&work[0].same_density, work[t].same_density, nthreads);
+        density_tensor_add(&work[0].intra_density, work[t].intra_density, nthreads);
+        density_tensor_add(&work[0].cross_density, work[t].cross_density, nthreads);
+        std::fill(work[t].same_density.data.begin(), work[t].same_density.data.end(), 0);
+        std::fill(work[t].intra_density.data.begin(), work[t].intra_density.data.end(), 0);
+        std::fill(work[t].cross_density.data.begin(), work[t].cross_density.data.end(), 0);
+      }
+    };
+
+    // frames already read by the run that is continued
+    int nresume = 0;
+    double tresume = 0;
+    if(!bTraj) {
+      for(const std::string &fn : merge) {
+        interm_state_read(fn.c_str(), &state, &work[0].same_density, &work[0].intra_density, &work[0].cross_density);
+        n_x += state.n_x;
+        nframe += state.nframe;
+        printf("Read %s with %ld analysed frames\n", fn.c_str(), static_cast<long>(state.n_x));
+      }
+    } else if(state_in) {
+      interm_state_read(state_in, &state, &work[0].same_density, &work[0].intra_density, &work[0].cross_density);
+      n_x = state.n_x;
+      nresume = state.nframe;
+      tresume = state.time;
+      printf("Continuing %s after %d frames\n", state_in, nresume);
+    }
+
     printf("Ready!\n"); fflush(stdout);
-    const char *atomname;
 
+    if(bTraj)
     do
     {
+        if(nframe < nresume) {
+          // already analysed, the last one should be the last frame of the continued run
+          if(nframe == nresume-1 && fr.time != tresume) {
+            gmx_fatal(FARGS, "Frame %d at time %g is not the last frame (time %g) of the continued -inter_mol run", nframe, fr.time, tresume);
+          }
+          nframe++;
+          continue;
+        }
         if ((nskip == 0) || ((nskip > 0) && ((nframe % nskip) == 0)))
         {
             t_pbc pbc;
             if (bPBC) set_pbc(&pbc, pbcType, fr.box);
 
             /* calculate the center of each molecule */
-            for (int i = 0; (i < nindex); i++)
-            {   
-                clear_rvec(xcm[i]);
-                double tm = 0.;
-                for (int ii = mols.block(i).begin(); ii < mols.block(i).end(); ii++)
+            mol_centers_calc(&centers, x, bPBC ? &pbc : nullptr, xcm);
+            heavy_atoms_gather(&heavy, x);
+
+            /* Pairs of molecules of the same type with the same heavy atoms give both molecules the same
+             * contacts, min(d(i.a, j.b), d(i.b, j.a)) for atoms a <= b, so every pair is visited once,
+             * by its first molecule, which stores the contacts found */
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+            for (int i = 0; i < nindex; i++)
+            {
+              try
+              {
+                t_interm_work &w = work[gmx_omp_get_thread_num()];
+                same_contacts[i].clear();
+                same_pairs[i].clear();
+                const int nat_i = natmol2[mol_id[i]];
+                const int* heavy_i = heavy.local.data() + heavy.start[i];
+                const int nh = heavy.start[i+1] - heavy.start[i];
+                for (int j = i+1; heavy.bTemplate[i] && j < nindex && mol_id[j]==mol_id[i]; j++)
                 {
-                    for (int m = 0; (m < DIM); m++)
+                    if(!heavy.bTemplate[j]) continue;
+                    rvec dx;
+                    if (bPBC) pbc_dx(&pbc, xcm[i], xcm[j], dx);
+                    else rvec_sub(xcm[i], xcm[j], dx);
+                    if (iprod(dx, dx) > mcut2) continue;
+
+                    heavy_atoms_dist2(heavy, i, j, x, bPBC ? &pbc : nullptr, w.pair_d2.data());
+                    t_contact_span span = { j, static_cast<int>(same_contacts[i].size()), 0 };
+                    for (int p = 0; p < nh; p++)
                     {
-                        xcm[i][m] += x[ii][m];
+                        for (int q = p; q < nh; q++)
+                        {
+                            real d2 = std::min(w.pair_d2[p*nh+q], w.pair_d2[q*nh+p]);
+                            if(d2 < cut_sig_2) same_contacts[i].push_back({ heavy_i[p]*nat_i+heavy_i[q], d2 });
+                        }
                     }
-                    tm += 1.0; 
-                }
-                for (int m = 0; (m < DIM); m++)
-                {
-                    xcm[i][m] /= tm;
+                    span.end = same_contacts[i].size();
+                    if(span.end > span.begin) same_pairs[i].push_back(span);
                 }
+              }
+              GMX_CATCH_ALL_AND_EXIT_WITH_FATAL_ERROR
+            }
+            // the contacts of every molecule, stored by itself or by the other molecule of the pair
+            for (int i = 0; i < nindex; i++) same_spans[i].clear();
+            for (int i = 0; i < nindex; i++) {
+              for (const t_contact_span &span : same_pairs[i]) {
+                same_spans[i].push_back({ i, span.begin, span.end });
+                same_spans[span.mol].push_back({ i, span.begin, span.end });
+              }
             }
 
-            /* Loop over molecules */
+            /* Loop over molecules, in parallel */
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
             for (int i = 0; i < nindex; i++)
             {
-                int molb = 0;
-                // Temporary structures for intermediate values
-                // this is to set that at least on interaction has been found
+              try
+              {
+                t_interm_work &w = work[gmx_omp_get_thread_num()];
                 // for each molecule we want to count an atom pair no more than once, and we consider the pair with the shorter distance
-                // matrices atm x atm for accumulating distances 
-                std::vector<std::vector<double> > interm_same_mat_mdist(natmol2[mol_id[i]], std::vector<double>(natmol2[mol_id[i]], 100.));    
-                std::vector<std::vector<double> > intram_mat_mdist(natmol2[mol_id[i]], std::vector<double>(natmol2[mol_id[i]], 100.));    
-                std::vector<std::vector<std::vector<double> > > interm_cross_mat_mdist((natmol2.size()*(natmol2.size()-1))/2);
-                for (std::size_t j = mol_id[i]+1; j < natmol2.size(); j++) {
-                    interm_cross_mat_mdist[cross_index[mol_id[i]][j]].resize(natmol2[mol_id[i]], std::vector<double>(natmol2[mol_id[j]], 100.));    
+                // matrices atm x atm for accumulating distances, only the pairs found are set
+                pair_mindist_begin(&w.same_mdist, natmol2[mol_id[i]]);
+                pair_mindist_begin(&w.intra_mdist, natmol2[mol_id[i]]);
+                for (const t_contact_span &span : same_spans[i]) {
+                    const t_mol_contact* c = same_contacts[span.mol].data();
+                    for (int n = span.begin; n < span.end; n++) pair_mindist_add(&w.same_mdist, c[n].k, c[n].d2);
                 }
-                /* Loop over molecules  */
+                /* Loop over the other molecules  */
                 for (int j = 0; j < nindex; j++)
                 {
+                    if(mol_id[i]!=mol_id[j]&&j<i) continue;
+                    // already in the contacts of the pair
+                    if(j!=i&&mol_id[i]==mol_id[j]&&heavy.bTemplate[i]&&heavy.bTemplate[j]) continue;
                     rvec dx;
                     if(j!=i) {
                       if (bPBC) pbc_dx(&pbc, xcm[i], xcm[j], dx);
@@ -889,138 +3183,111 @@ static void do_interm_mat(const char*             trx,
                       double dx2 = iprod(dx, dx);
                       if (dx2 > mcut2) continue;
                     }
-                    if(mol_id[i]!=mol_id[j]&&j<i) continue;
 
-                    /* Compute distance */
-                    int a_i = 0;
-                    GMX_RELEASE_ASSERT(mols.numBlocks() > 0,"Cannot access index[] from empty mols");
-                    for (int ii = mols.block(i).begin(); ii < mols.block(i).end(); ii++)
+                    /* Compute distance between the heavy atoms */
+                    const int* heavy_i = heavy.local.data() + heavy.start[i];
+                    const int* heavy_j = heavy.local.data() + heavy.start[j];
+                    const int nh_i = heavy.start[i+1] - heavy.start[i];
+                    const int nh_j = heavy.start[j+1] - heavy.start[j];
+                    const bool bInvert = (i!=j&&mol_id[i]==mol_id[j]);
+                    heavy_atoms_dist2(heavy, i, j, x, bPBC ? &pbc : nullptr, w.pair_d2.data());
+                    for (int p = 0; p < nh_i; p++)
                     {
-                        int a_j = 0;
-                        mtopGetAtomAndResidueName(mtop, ii, &molb, &atomname, nullptr, nullptr, nullptr);
-                        if(atomname[0]=='H') {a_i++; continue;}
-                        for (int jj = mols.block(j).begin(); jj < mols.block(j).end(); jj++)
+                        int a_i = heavy_i[p];
+                        for (int q = 0; q < nh_j; q++)
                         {
-                            mtopGetAtomAndResidueName(mtop, jj, &molb, &atomname, nullptr, nullptr, nullptr);
-                            if(atomname[0]=='H') {a_j++; continue;}
-                            if (bPBC) pbc_dx(&pbc, x[ii], x[jj], dx);
-                            else rvec_sub(x[ii], x[jj], dx);
-                            double dx2 = iprod(dx, dx);
-                            double dx3 = 100;
-                            int delta = a_i-a_j;
-                            if(i!=j&&mol_id[i]==mol_id[j]) {
-                              // this is to account for inversion atom/molecule
-                              if (bPBC) pbc_dx(&pbc, x[ii-delta], x[jj+delta], dx);
-                              else rvec_sub(x[ii-delta], x[jj+delta], dx);
-                              dx3 = iprod(dx, dx);
+                            int a_j = heavy_j[q];
+                            double dx2 = w.pair_d2[p*nh_j+q];
+                            // this is to account for inversion atom/molecule:
+                            // atom a_j of molecule i with atom a_i of molecule j
+                            if(bInvert) {
+                              if (bPBC) pbc_dx(&pbc, x[*mols.block(i).begin()+a_j], x[*mols.block(j).begin()+a_i], dx);
+                              else rvec_sub(x[*mols.block(i).begin()+a_j], x[*mols.block(j).begin()+a_i], dx);
+                              dx2 = std::min(dx2, static_cast<double>(iprod(dx, dx)));
                             }
-                            if(dx3<dx2) dx2=dx3;
 
                             if(dx2 < cut_sig_2) {
                                 if(i!=j) { // intermolecular
                                    if(mol_id[i]==mol_id[j]) { // inter same molecule specie
-                                      interm_same_mat_mdist[a_i][a_j] = std::min(interm_same_mat_mdist[a_i][a_j], dx2);
+                                      pair_mindist_add(&w.same_mdist, a_i, a_j, dx2);
                                    } else { // inter cross molecule specie
-                                      interm_cross_mat_mdist[cross_index[mol_id[i]][mol_id[j]]][a_i][a_j] = std::min(interm_cross_mat_mdist[cross_index[mol_id[i]][mol_id[j]]][a_i][a_j], dx2);
+                                      pair_mindist_add(&w.cross_mdist[cross_index[mol_id[i]][mol_id[j]]], a_i, a_j, dx2);
                                    }
                                 } else { // intramolecular
-                                   intram_mat_mdist[a_i][a_j] = std::min(intram_mat_mdist[a_i][a_j], dx2);
+                                   pair_mindist_add(&w.intra_mdist, a_i, a_j, dx2);
                                 }
                             }
-                            a_j++;
                         }
-                        a_i++;
                     }
                 }
-                for(int ii=0; ii<natmol2[mol_id[i]]; ii++) {
-                   for(int jj=ii; jj<natmol2[mol_id[i]]; jj++) {
-                      if(interm_same_mat_mdist[ii][jj]<100.) {
-                        kernel_density_estimator(interm_same_mat_density[mol_id[i]][ii][jj], density_bins, std::sqrt(interm_same_mat_mdist[ii][jj]), inv_num_mol[i]);
-                      } 
-                      if(intram_mat_mdist[ii][jj]<100.) {
-                        kernel_density_estimator(intram_mat_density[mol_id[i]][ii][jj], density_bins, std::sqrt(intram_mat_mdist[ii][jj]), inv_num_mol[i]);
-                      }
+                // only the pairs found contribute, each one to its own density function
+                const int nat_i = natmol2[mol_id[i]];
+                for(int k : w.same_mdist.set) {
+                   if(k%nat_i >= k/nat_i) {
+                     kernel_density_estimator(density_tensor_row(&w.same_density, mol_id[i], k/nat_i, k%nat_i), kde, std::sqrt(w.same_mdist.d2[k]), inv_num_mol[i]);
+                   }
+                }
+                for(int k : w.intra_mdist.set) {
+                   if(k%nat_i >= k/nat_i) {
+                     kernel_density_estimator(density_tensor_row(&w.intra_density, mol_id[i], k/nat_i, k%nat_i), kde, std::sqrt(w.intra_mdist.d2[k]), inv_num_mol[i]);
                    }
                 }
+                pair_mindist_reset(&w.same_mdist);
+                pair_mindist_reset(&w.intra_mdist);
                 for (std::size_t j = mol_id[i]+1; j < natmol2.size(); j++) {
-                   for(int ii=0; ii<natmol2[mol_id[i]]; ii++) {
-                      for(int jj=0; jj<natmol2[mol_id[j]]; jj++) {
-                         if(interm_cross_mat_mdist[cross_index[mol_id[i]][j]][ii][jj]<100.) {
-                           kernel_density_estimator(interm_cross_mat_density[cross_index[mol_id[i]][j]][ii][jj], density_bins, std::sqrt(interm_cross_mat_mdist[cross_index[mol_id[i]][j]][ii][jj]),std::max(inv_num_mol[i],inv_num_mol[j]));
-                         }
-                      }
+                   t_pair_mindist* cross = &w.cross_mdist[cross_index[mol_id[i]][j]];
+                   for(int k : cross->set) {
+                      kernel_density_estimator(density_tensor_row(&w.cross_density, cross_index[mol_id[i]][j], k/cross->nj, k%cross->nj), kde, std::sqrt(cross->d2[k]),std::max(inv_num_mol[i],inv_num_mol[j]));
                    }
+                   pair_mindist_reset(cross);
                 } 
+              }
+              GMX_CATCH_ALL_AND_EXIT_WITH_FATAL_ERROR
             }
             n_x++;
+            if(state_out && nckpt > 0 && n_x % nckpt == 0) {
+              reduce_work();
+              state.nframe = nframe+1;
+              state.n_x = n_x;
+              state.time = fr.time;
+              interm_state_write(state_out, state, work[0].same_density, work[0].intra_density, work[0].cross_density);
+            }
         }
+        state.time = fr.time;
         nframe++;
     } while (read_next_frame(oenv, status, &fr));
-    close_trx(status);
-    done_frame(&fr);
+    if(bTraj) {
+      close_trx(status);
+      done_frame(&fr);
+      if(nframe < nresume) {
+        gmx_fatal(FARGS, "The trajectory has %d frames, fewer than the %d frames of the continued -inter_mol run", nframe, nresume);
+      }
+    }
 
     sfree(xcm);
+
+    // sum the density functions of the threads
+    reduce_work();
+    if(state_out) {
+      state.nframe = nframe;
+      state.n_x = n_x;
+      interm_state_write(state_out, state, work[0].same_density, work[0].intra_density, work[0].cross_density);
+    }
+    if(n_x == 0) {
+      gmx_fatal(FARGS, "No frames were analysed");
+    }
+    const t_density_tensor &interm_same_mat_density = work[0].same_density;
+    const t_density_tensor &intram_mat_density = work[0].intra_density;
+    const t_density_tensor &interm_cross_mat_density = work[0].cross_density;
     printf("Done!\n"); fflush(stdout);
 
-    // normalisations
+    // normalisations, applied in double when reading the tensors
+    // the same molecule type matrices are symmetric, only ii <= jj is stored
     double norm = 1./n_x;
+    std::vector<double> dens;
 
-    for(std::size_t i=0; i<natmol2.size(); i++) {
-       for(int ii=0; ii<natmol2[i]; ii++) {
-          for(int jj=ii; jj<natmol2[i]; jj++) {
-             std::transform(interm_same_mat_density[i][ii][jj].begin(), interm_same_mat_density[i][ii][jj].end(), interm_same_mat_density[i][ii][jj].begin(), [&norm](auto& c){return c*norm;});
-             std::transform(intram_mat_density[i][ii][jj].begin(), intram_mat_density[i][ii][jj].end(), intram_mat_density[i][ii][jj].begin(), [&norm](auto& c){return c*norm;});
-             interm_same_mat_density[i][jj][ii]=interm_same_mat_density[i][ii][jj];
-             intram_mat_density[i][jj][ii]=intram_mat_density[i][ii][jj];
-          }
-       }
-       for(std::size_t j=i+1; j<natmol2.size(); j++) {
-          for(int ii=0; ii<natmol2[i]; ii++) {
-             for(int jj=0; jj<natmol2[j]; jj++) {
-                std::transform(interm_cross_mat_density[cross_index[i][j]][ii][jj].begin(), interm_cross_mat_density[cross_index[i][j]][ii][jj].end(), interm_cross_mat_density[cross_index[i][j]][ii][jj].begin(), [&norm](auto& c){return c*norm;});
-             }
-          }
-       }
-    }
-
-    if(write_histo) {
-       for(std::size_t i=0; i<natmol2.size(); i++) {
-          for(int ii=0; ii<natmol2[i]; ii++) {
-             FILE *fp_inter = nullptr;
-             FILE *fp_intra = nullptr;
-             std::string ffh_inter = "inter_mol_"+std::to_string(i+1)+"_"+std::to_string(i+1)+"_aa_"+std::to_string(ii+1)+".dat";
-             fp_inter = gmx_ffopen(ffh_inter, "w");
-             std::string ffh_intra = "intra_mol_"+std::to_string(i+1)+"_"+std::to_string(i+1)+"_aa_"+std::to_string(ii+1)+".dat";
-             fp_intra = gmx_ffopen(ffh_intra, "w");
-             for(int k=0; k<interm_same_mat_density[i][ii][0].size(); k++) {
-                fprintf(fp_inter, "%lf",  density_bins[k]);
-                fprintf(fp_intra, "%lf",  density_bins[k]);
-                for(int jj=0; jj<natmol2[i]; jj++) {
-                      fprintf(fp_inter, " %lf",  interm_same_mat_density[i][ii][jj][k]);
-                      fprintf(fp_intra, " %lf",  intram_mat_density[i][ii][jj][k]);
-                }
-                fprintf(fp_inter,"\n");
-                fprintf(fp_intra,"\n");
-             }
-             gmx_ffclose(fp_inter);
-             gmx_ffclose(fp_intra);
-          }
-          for(std::size_t j=i+1; j<natmol2.size(); j++) {
-             for(int ii=0; ii<natmol2[i]; ii++) {
-                FILE *fp = nullptr;
-                std::string ffh = "inter_mol_"+std::to_string(i+1)+"_"+std::to_string(j+1)+"_aa_"+std::to_string(ii+1)+".dat";
-                fp = gmx_ffopen(ffh, "w");
-		for(int k=0; k<interm_cross_mat_density[cross_index[i][j]][ii][0].size(); k++) {
-                   fprintf(fp, "%lf",  density_bins[k]);
-                   for(int jj=0; jj<natmol2[j]; jj++) {
-                      fprintf(fp, " %lf", interm_cross_mat_density[cross_index[i][j]][ii][jj][k]);
-                   }
-                   fprintf(fp, "\n");
-                }
-                gmx_ffclose(fp);
-             }
-          }
-       }
+    if(histo_out) {
+       interm_histo_write(histo_out, natmol2, density_bins, cross_index, interm_same_mat_density, intram_mat_density, interm_cross_mat_density, norm);
     }
 
     for(int i=0; i<natmol2.size(); i++) {
@@ -1030,9 +3297,10 @@ static void do_interm_mat(const char*             trx,
        fp = gmx_ffopen(inter_file_name.insert(found,"_"+std::to_string(i+1)+"_"+std::to_string(i+1)), "w");
        for(int ii=0; ii<natmol2[i]; ii++) {
           for(int jj=0; jj<natmol2[i]; jj++) {
-             double dx = cut/static_cast<double>(interm_same_mat_density[i][ii][jj].size());
-             double dm = calc_mean(interm_same_mat_density[i][ii][jj], dx);
-             double prob = calc_prob(interm_same_mat_density[i][ii][jj], dx);
+             density_tensor_get(interm_same_mat_density, i, std::min(ii,jj), std::max(ii,jj), norm, &dens);
+             double dx = cut/static_cast<double>(dens.size());
+             double dm = calc_mean(dens, dx);
+             double prob = calc_prob(dens, dx);
              fprintf(fp, "%4i %4i %4i %4i %9.6lf %9.6lf\n", i+1, ii+1, i+1, jj+1, dm, prob);
           }
        }
@@ -1042,9 +3310,10 @@ static void do_interm_mat(const char*             trx,
        fp = gmx_ffopen(intra_file_name.insert(found,"_"+std::to_string(i+1)+"_"+std::to_string(i+1)), "w");
        for(int ii=0; ii<natmol2[i]; ii++) {
           for(int jj=0; jj<natmol2[i]; jj++) {
-             double dx = cut/static_cast<double>(intram_mat_density[i][ii][jj].size());
-	     double dm = calc_mean(intram_mat_density[i][ii][jj], dx);
-	     double prob = calc_prob(intram_mat_density[i][ii][jj], dx);
+             density_tensor_get(intram_mat_density, i, std::min(ii,jj), std::max(ii,jj), norm, &dens);
+             double dx = cut/static_cast<double>(dens.size());
+	     double dm = calc_mean(dens, dx);
+	     double prob = calc_prob(dens, dx);
              fprintf(fp, "%4i %4i %4i %4i %9.6lf %9.6lf\n", i+1, ii+1, i+1, jj+1, dm, prob);
           }
        }
@@ -1055,9 +3324,10 @@ static void do_interm_mat(const char*             trx,
           fp = gmx_ffopen(inter_c_file_name.insert(found,"_"+std::to_string(i+1)+"_"+std::to_string(j+1)), "w");
           for(int ii=0; ii<natmol2[i]; ii++) {
              for(int jj=0; jj<natmol2[j]; jj++) {
-                double dx = cut/static_cast<double>(interm_cross_mat_density[cross_index[i][j]][ii][jj].size());
-	        double dm = calc_mean(interm_cross_mat_density[cross_index[i][j]][ii][jj], dx);
-	        double prob = calc_prob(interm_cross_mat_density[cross_index[i][j]][ii][jj], dx);
+                density_tensor_get(interm_cross_mat_density, cross_index[i][j], ii, jj, norm, &dens);
+                double dx = cut/static_cast<double>(dens.size());
+	        double dm = calc_mean(dens, dx);
+	        double prob = calc_prob(dens, dx);
                 fprintf(fp, "%4i %4i %4i %4i %9.6lf %9.6lf\n", i+1, ii+1, j+1, jj+1, dm, prob);
              }
           }
@@ -1076,26 +3346,64 @@ int gmx_clustsize(int argc, char* argv[])
         "molecules rather than atoms, which allows clustering of large molecules.",
         "In this case an index file would still contain atom numbers",
         "or your calculation will die with a SEGV.[PAR]",
+        "With [TT]-mol[tt] and a non-zero [TT]-skin[tt] the candidate molecule pairs are",
+        "kept in a list with that buffer, which is only rebuilt after the molecules moved",
+        "more than half of the buffer. The clusters are the same as without it.[PAR]",
         "When velocities are present in your trajectory, the temperature of",
         "the largest cluster will be printed in a separate [REF].xvg[ref] file assuming",
         "that the particles are free to move. If you are using constraints,",
         "please correct the temperature. For instance water simulated with SHAKE",
         "or SETTLE will yield a temperature that is 1.5 times too low. You can",
         "compensate for this with the [TT]-ndf[tt] option. Remember to take the removal",
-        "of center of mass motion into account.[PAR]",
+        "of center of mass motion into account. With [TT]-mol[tt] the degrees of freedom are",
+        "those of the atoms of the molecules in the cluster. [TT]-tc[tt] gives the temperature",
+        "of every cluster in every frame.[PAR]",
         "The [TT]-mc[tt] option will produce an index file containing the",
-        "atom numbers of the largest cluster."
+        "atom numbers of the largest cluster.[PAR]",
+        "With [TT]-tr_olig_ndx[tt] the atoms of the oligomers of each size are written for",
+        "every frame to a single binary archive ([TT]-olig[tt]). The index file of one frame",
+        "can be extracted from it later with [TT]-xolig[tt], [TT]-olig_frame[tt] and",
+        "[TT]-olig_size[tt], in which case no trajectory is read.[PAR]",
+        "The cluster label of every molecule is written for every analysed frame as",
+        "text to [TT]-ict[tt] and, when set, to the binary file [TT]-icb[tt], which",
+        "stores only the labels that changed since the previous frame.[PAR]",
+        "With [TT]-cuts[tt] the clusters are also determined for a list of cutoffs in a single",
+        "pass, from the shortest distances between all pairs closer than the largest cutoff.",
+        "The number of clusters and the largest cluster for each cutoff are written to",
+        "[TT]-ncuts[tt] and [TT]-mcuts[tt], the average cluster size distributions to [TT]-hcuts[tt].[PAR]",
+        "With [TT]-inter_mol[tt], [TT]-imstate[tt] writes the density functions before their",
+        "normalisation, with the number of frames and the settings, at the end of the run and with",
+        "[TT]-ckpt[tt] also every so many analysed frames. [TT]-imresume[tt] continues a run from such",
+        "a state, skipping the frames it already read. Runs over parts of a trajectory, selected with",
+        "[TT]-b[tt] and [TT]-e[tt], are combined with [TT]-immerge[tt], which sums their states and",
+        "writes the outputs without reading a trajectory, so that [TT]-f[tt] is not needed.[PAR]",
+        "With [TT]-inter_mol[tt] and [TT]-histo[tt] the distance density functions of all atom pairs",
+        "are written to a single binary archive ([TT]-imhisto[tt]). [TT]-xhisto[tt] writes them from it",
+        "as text, one file per atom and molecule type pair, in which case no trajectory is read.[PAR]",
+        "With [TT]-lt[tt], [TT]-lta[tt] or [TT]-ev[tt] clusters are followed over the frames:",
+        "a cluster keeps the identity of the cluster in the previous frame with which it shares",
+        "more than half of the union of their molecules. [TT]-lt[tt] gives the distribution of",
+        "the time a cluster keeps its identity and size for each oligomer order, [TT]-lta[tt] its",
+        "average, and [TT]-ev[tt] lists the fusion and fission events."
     };
 
     real     cutoff = 0.50;
     real     mol_cutoff = 6.00;
+    real     kde_h      = 0.01;
+    real     skin       = 0.0;
+    const char* cuts    = "";
     int      bOndx   = 0;
+    int      olig_frame = 0;
+    int      olig_size  = 0;
     int      nskip   = 0;
     int      skip_last_nmol = 0;
     int      nlevels = 20;
     int      ndf     = -1;
+    int      nThreads = 1;
+    int      nckpt    = 0;
     gmx_bool bMol    = FALSE;
     gmx_bool bPBC    = TRUE;
+    gmx_bool bMassC  = FALSE;
     gmx_bool iMAT    = FALSE;
     gmx_bool iMAThis = FALSE;
     rvec     rlo     = { 1.0, 1.0, 0.0 };
@@ -1114,11 +3422,31 @@ int gmx_clustsize(int argc, char* argv[])
           etREAL,
           { &mol_cutoff },
           "Largest distance (nm) to be considered between molecules in a cluster" },
+        { "-skin",
+          FALSE,
+          etREAL,
+          { &skin },
+          "With -mol, buffer (nm) of a molecule pair list that is only rebuilt when molecules moved more than half of it, 0 rebuilds every frame" },
+        { "-cuts",
+          FALSE,
+          etSTR,
+          { &cuts },
+          "List of cutoffs (nm) to determine the clusters for in a single pass, e.g. \"0.35 0.4 0.5\"" },
         { "-mol",
           FALSE,
           etBOOL,
           { &bMol },
           "Cluster molecules rather than atoms (needs [REF].tpr[ref] file)" },
+        { "-kde_h",
+          FALSE,
+          etREAL,
+          { &kde_h },
+          "With -inter_mol, bandwidth (nm) of the Gaussian kernel used for the distance density functions" },
+        { "-ckpt",
+          FALSE,
+          etINT,
+          { &nckpt },
+          "With -inter_mol and -imstate, write the state every this many analysed frames, 0 only at the end" },
         { "-inter_mol",
           FALSE,
           etBOOL,
@@ -1128,14 +3456,29 @@ int gmx_clustsize(int argc, char* argv[])
           FALSE,
           etBOOL,
           { &iMAThis },
-          "with -inter_mol plots the histogram of the distances for all pairs (needs [REF].tpr[ref] file)" },
+          "with -inter_mol writes the histograms of the distances for all pairs to the -imhisto archive (needs [REF].tpr[ref] file)" },
         { "-skip_last_nmol", FALSE, etINT, { &skip_last_nmol }, "Number of molecules to skip (from the end)" },
         { "-tr_olig_ndx",
           FALSE,
           etINT,
           { &bOndx },
-          "write index files for all oligomers size from 2 to tr_olig_ndx for every frame, it could enerate A LOT of files" },
+          "write the atoms of all oligomers of size 2 to tr_olig_ndx for every frame to the -olig archive" },
+        { "-olig_frame",
+          FALSE,
+          etINT,
+          { &olig_frame },
+          "with -xolig, trajectory frame to extract from the oligomer archive" },
+        { "-olig_size",
+          FALSE,
+          etINT,
+          { &olig_size },
+          "with -xolig, oligomer size to extract from the oligomer archive, all sizes when 0" },
         { "-pbc", FALSE, etBOOL, { &bPBC }, "Use periodic boundary conditions" },
+        { "-mol_com",
+          FALSE,
+          etBOOL,
+          { &bMassC },
+          "Use the center of mass rather than the geometric center of the molecules for -mol_cut (needs [REF].tpr[ref] file)" },
         { "-nskip", FALSE, etINT, { &nskip }, "Number of frames to skip between writing" },
         { "-nlevels",
           FALSE,
@@ -1148,6 +3491,13 @@ int gmx_clustsize(int argc, char* argv[])
           { &ndf },
           "Number of degrees of freedom of the entire system for temperature calculation. "
           "If not set, the number of atoms times three is used." },
+        { "-nthreads",
+          FALSE,
+          etINT,
+          { &nThreads },
+          "Number of threads clustering frames, or with -inter_mol analysing molecules, in parallel, "
+          "nThreads <= 0 means the maximum number of threads. Requires linking with OpenMP. With "
+          "-inter_mol every thread accumulates its own copy of the density functions." },
         { "-rgblo",
           FALSE,
           etRVEC,
@@ -1164,18 +3514,34 @@ int gmx_clustsize(int argc, char* argv[])
     t_rgb       rgblo, rgbhi;
 
     t_filenm fnm[] = {
-        { efTRX, "-f", nullptr, ffREAD },         { efTPR, nullptr, nullptr, ffOPTRD },
+        { efTRX, "-f", nullptr, ffOPTRD },        { efTPR, nullptr, nullptr, ffOPTRD },
         { efNDX, nullptr, nullptr, ffOPTRD },     { efXPM, "-o", "csize", ffWRITE },
         { efXPM, "-ow", "csizew", ffWRITE },      { efXVG, "-nc", "nclust", ffWRITE },
         { efXVG, "-mc", "maxclust", ffWRITE },    { efXVG, "-ac", "avclust", ffWRITE },
         { efXVG, "-hc", "histo-clust", ffWRITE }, { efXVG, "-temp", "temp", ffOPTWR },
         { efXVG, "-hct", "histo-time", ffWRITE },
+        { efDAT, "-tc", "clust-temp", ffOPTWR },
+        { efXVG, "-ncuts", "nclust-cuts", ffOPTWR },
+        { efXVG, "-mcuts", "maxclust-cuts", ffOPTWR },
+        { efXVG, "-hcuts", "histo-clust-cuts", ffOPTWR },
         { efXVG, "-ict", "clust-index-time", ffWRITE },
+        { efDAT, "-icb", "clust-index", ffOPTWR },
+        { efXVG, "-lt", "lifetime", ffOPTWR },
+        { efXVG, "-lta", "avlifetime", ffOPTWR },
+        { efDAT, "-ev", "cluster-events", ffOPTWR },
         { efXVG, "-trm", "transitions-matrix", ffWRITE },
         { efXVG, "-km", "rates-matrix", ffWRITE },
         { efNDX, "-mcn", "maxclust", ffOPTWR },
+        { efDAT, "-olig", "oligomers", ffOPTWR },
+        { efDAT, "-xolig", "oligomers", ffOPTRD },
+        { efNDX, "-on", "oligomers", ffOPTWR },
         { efNDX, "-irmat", "intermat", ffOPTWR },
-        { efNDX, "-iamat", "intramat", ffOPTWR }
+        { efNDX, "-iamat", "intramat", ffOPTWR },
+        { efDAT, "-imhisto", "intermat-histo", ffOPTWR },
+        { efDAT, "-xhisto", "intermat-histo", ffOPTRD },
+        { efDAT, "-imstate", "intermat-state", ffOPTWR },
+        { efDAT, "-imresume", "intermat-state", ffOPTRD },
+        { efDAT, "-immerge", "intermat-state", ffOPTRDMULT }
     };
 #define NFILE asize(fnm)
 
@@ -1185,6 +3551,21 @@ int gmx_clustsize(int argc, char* argv[])
         return 0;
     }
 
+    if (opt2bSet("-xolig", NFILE, fnm))
+    {
+        /* Only extract an index file from an existing oligomer archive */
+        olig_archive_extract(opt2fn("-xolig", NFILE, fnm), olig_frame, olig_size, opt2fn("-on", NFILE, fnm));
+        output_env_done(oenv);
+        return 0;
+    }
+    if (opt2bSet("-xhisto", NFILE, fnm))
+    {
+        /* Only write the histograms of an existing archive as text */
+        interm_histo_extract(opt2fn("-xhisto", NFILE, fnm));
+        output_env_done(oenv);
+        return 0;
+    }
+
     if(iMAT) bMol = TRUE;
  
     fnNDX   = ftp2fn_null(efNDX, NFILE, fnm);
@@ -1200,6 +3581,47 @@ int gmx_clustsize(int argc, char* argv[])
     {
         gmx_fatal(FARGS, "You need a tpr file for the -mol option");
     }
+    if (bMassC && !fnTPR)
+    {
+        gmx_fatal(FARGS, "You need a tpr file for the -mol_com option");
+    }
+    if (iMAT && kde_h <= 0)
+    {
+        gmx_fatal(FARGS, "The -kde_h bandwidth should be positive");
+    }
+
+    /* Cutoffs are read as reals, so a cutoff of -cuts gives the same clusters as with -cut */
+    std::vector<double> cut_list;
+    for (const std::string& word : gmx::splitString(cuts))
+    {
+        char* end;
+        real  c = std::strtod(word.c_str(), &end);
+        if (*end != '\0' || c <= 0)
+        {
+            gmx_fatal(FARGS, "Invalid cutoff '%s' in -cuts", word.c_str());
+        }
+        cut_list.push_back(c);
+    }
+    std::sort(cut_list.begin(), cut_list.end());
+
+    if (nThreads <= 0)
+    {
+        nThreads = gmx_omp_get_max_threads();
+    }
+
+    gmx::ArrayRef<const std::string> merge;
+    if (opt2bSet("-immerge", NFILE, fnm))
+    {
+        merge = opt2fns("-immerge", NFILE, fnm);
+    }
+    if (!iMAT && (!merge.empty() || opt2bSet("-imstate", NFILE, fnm) || opt2bSet("-imresume", NFILE, fnm)))
+    {
+        gmx_fatal(FARGS, "-imstate, -imresume and -immerge need -inter_mol");
+    }
+    if (!merge.empty() && opt2bSet("-imresume", NFILE, fnm))
+    {
+        gmx_fatal(FARGS, "-imresume continues a trajectory, it can not be combined with -immerge");
+    }
 
     if(!iMAT)
     clust_size(fnNDX,
@@ -1212,15 +3634,27 @@ int gmx_clustsize(int argc, char* argv[])
                opt2fn("-hc", NFILE, fnm),
                opt2fn("-hct", NFILE, fnm),
                opt2fn("-ict", NFILE, fnm),
+               opt2fn_null("-icb", NFILE, fnm),
+               opt2fn_null("-lt", NFILE, fnm),
+               opt2fn_null("-lta", NFILE, fnm),
+               opt2fn_null("-ev", NFILE, fnm),
                opt2fn("-trm", NFILE, fnm),
                opt2fn("-km", NFILE, fnm),
                opt2fn("-temp", NFILE, fnm),
+               opt2fn_null("-tc", NFILE, fnm),
                opt2fn("-mcn", NFILE, fnm),
+               opt2fn("-olig", NFILE, fnm),
+               opt2fn("-ncuts", NFILE, fnm),
+               opt2fn("-mcuts", NFILE, fnm),
+               opt2fn("-hcuts", NFILE, fnm),
                bMol,
                bPBC,
+               bMassC,
                fnTPR,
                cutoff,
                mol_cutoff,
+               skin,
+               cut_list,
                bOndx,
                nskip,
                skip_last_nmol,
@@ -1228,6 +3662,7 @@ int gmx_clustsize(int argc, char* argv[])
                rgblo,
                rgbhi,
                ndf,
+               nThreads,
                oenv);
 
     else if(iMAT)
@@ -1235,12 +3670,19 @@ int gmx_clustsize(int argc, char* argv[])
                   opt2fn("-irmat", NFILE, fnm),
                   opt2fn("-iamat", NFILE, fnm),
                   bPBC,
+                  bMassC,
                   fnTPR,
                   cutoff,
                   mol_cutoff,
+                  kde_h,
                   nskip,
                   skip_last_nmol,
-                  iMAThis,
+                  iMAThis ? opt2fn("-imhisto", NFILE, fnm) : nullptr,
+                  nThreads,
+                  opt2fn_null("-imstate", NFILE, fnm),
+                  opt2fn_null("-imresume", NFILE, fnm),
+                  merge,
+                  nckpt,
                   oenv);
 
     output_env_done(oenv);
@@ -37,6 +37,7 @@
 #include <cstring>
 
 #include <array>
+#include <cstdint>
 #include <vector>
 
 #include "gromacs/commandline/pargs.h"
@@ -55,69 +56,90 @@
 #include "gromacs/topology/topology.h"
 #include "gromacs/utility/arraysize.h"
 #include "gromacs/utility/fatalerror.h"
+#include "gromacs/utility/futil.h"
+#include "gromacs/utility/gmxomp.h"
 #include "gromacs/utility/smalloc.h"
 
-static real calc_gyro(rvec     x[],
-                      int      gnx,
-                      int      index[],
-                      t_atom   atom[],
-                      real     tm,
-                      rvec     gvec,
-                      rvec     d,
-                      gmx_bool bMassW,
-                      gmx_bool bQ,
-                      gmx_bool bRot,
-                      gmx_bool bMOI,
-                      matrix   trans)
+/* Radii of gyration of the nmol molecules of nam atoms of the analysis group, in parallel over
+ * the molecules. The atoms index of x are gathered in xg, molecule after molecule, and moved
+ * to the center of their molecule with the weights w. For every molecule the radius, or with
+ * bMOI the norm of the moments of inertia, is returned in gyro and the radii about the axes
+ * in gvec. With bRot the principal components, computed with the masses mass, are returned
+ * in d, as radii unless bMOI, and the principal axes in trans.
+ */
+static void calc_gyro_mols(int         nmol,
+                           int         nam,
+                           const int   index[],
+                           const rvec  x[],
+                           rvec        xg[],
+                           const real  w[],
+                           const real  mass[],
+                           gmx_bool    bRot,
+                           gmx_bool    bMOI,
+                           real        gyro[],
+                           rvec        gvec[],
+                           rvec        d[],
+                           matrix      trans[],
+                           int         nthreads)
 {
-    int  i, ii, m;
-    real gyro, dx2, m0, Itot;
-    rvec comp;
-
-    if (bRot)
-    {
-        principal_comp(gnx, index, atom, x, trans, d);
-        Itot = norm(d);
-        if (bMOI)
-        {
-            return Itot;
-        }
-        for (m = 0; (m < DIM); m++)
-        {
-            d[m] = std::sqrt(d[m] / tm);
-        }
-        /* rotate_atoms(gnx,index,x,trans); */
-    }
-    clear_rvec(comp);
-    for (i = 0; (i < gnx); i++)
+#pragma omp parallel for num_threads(nthreads) schedule(static)
+    for (int mol = 0; mol < nmol; mol++)
     {
-        ii = index[i];
-        if (bQ)
+        const int start[2] = { mol * nam, (mol + 1) * nam };
+        rvec      xcm;
+
+        for (int i = start[0]; (i < start[1]); i++)
         {
-            m0 = std::abs(atom[ii].q);
+            copy_rvec(x[index[i]], xg[i]);
         }
-        else if(!bMassW)
+        const real tm = sub_xcm_weighted(xg + start[0], nam, nullptr, w + start[0], xcm);
+
+        if (bRot)
         {
-            m0 = 1;
+            principal_comp_groups(1, start, xg, mass, &trans[mol], &d[mol]);
+            if (bMOI)
+            {
+                gyro[mol] = norm(d[mol]);
+                clear_rvec(gvec[mol]);
+                continue;
+            }
+            for (int m = 0; (m < DIM); m++)
+            {
+                d[mol][m] = std::sqrt(d[mol][m] / tm);
+            }
         }
-        else
+
+        double comp[DIM] = { 0, 0, 0 };
+        for (int i = start[0]; (i < start[1]); i++)
         {
-            m0 = atom[ii].m;
+            comp[XX] += w[i] * xg[i][XX] * xg[i][XX];
+            comp[YY] += w[i] * xg[i][YY] * xg[i][YY];
+            comp[ZZ] += w[i] * xg[i][ZZ] * xg[i][ZZ];
         }
-        for (m = 0; (m < DIM); m++)
+        const double g = comp[XX] + comp[YY] + comp[ZZ];
+        for (int m = 0; (m < DIM); m++)
         {
-            dx2 = x[ii][m] * x[ii][m];
-            comp[m] += dx2 * m0;
+            gvec[mol][m] = std::sqrt((g - comp[m]) / tm);
         }
+        gyro[mol] = std::sqrt(g / tm);
     }
-    gyro = comp[XX] + comp[YY] + comp[ZZ];
+}
 
-    for (m = 0; (m < DIM); m++)
+/* The -om file starts with the magic string, the number of molecules and the kind of
+ * the components (int32, 0: radii about x, y and z, 1: radii about the principal axes,
+ * 2: moments of inertia). Every frame follows as the time (double) and per molecule
+ * the radius, or the norm of the moments of inertia, and the three components (float),
+ * so that frame f starts at byte 16 + f (8 + 16 nmol). Values are stored with the
+ * native byte order.
+ */
+static const char c_gyroMolMagic[8] = { 'G', 'Y', 'R', 'M', 'O', 'L', '0', '1' };
+
+static void gyro_fwrite(const void* ptr, std::size_t size, std::size_t n, FILE* fp)
+{
+    if (fwrite(ptr, size, n, fp) != n)
     {
-        gvec[m] = std::sqrt((gyro - comp[m]) / tm);
+        gmx_fatal(FARGS, "Could not write the per-molecule radii of gyration");
     }
-
-    return std::sqrt(gyro / tm);
 }
 
 static void calc_gyro_z(rvec x[], matrix box, int gnx, const int index[], t_atom atom[], int nz, real time, FILE* out)
@@ -192,14 +214,33 @@ int gmx_gyrate(int argc, char* argv[])
         "Rg(x) = sqrt((sum_i m_i (R_i(y)^2 + R_i(z)^2))/(sum_i m_i)).[PAR]",
         "With the [TT]-nmol[tt] option the radius of gyration will be calculated",
         "for multiple molecules by splitting the analysis group in equally",
-        "sized parts.[PAR]",
+        "sized parts. The molecules are analysed in parallel with [TT]-nthreads[tt] threads.",
+        "Since the average over the molecules hides their spread, [TT]-om[tt] writes the",
+        "radius of gyration and its three components of every molecule in every frame to",
+        "a binary file (with [TT]-moi[tt] the moments of inertia instead), and [TT]-dist[tt],",
+        "which can not be combined with [TT]-moi[tt], writes the distribution of the radii",
+        "of gyration of the molecules over all frames",
+        "with bin width [TT]-binw[tt]. Radii that are not finite, e.g. of molecules with",
+        "zero total charge with [TT]-q[tt], are left out of the distribution.[PAR]",
         "With the option [TT]-nz[tt] 2D radii of gyration in the [IT]x-y[it] plane",
         "of slices along the [IT]z[it]-axis are calculated."
     };
-    static int      nmol = 1, nz = 0;
+    static int      nmol = 1, nz = 0, nthreads = 1;
+    static real     binw = 0.01;
     static gmx_bool bMassW = TRUE, bQ = FALSE, bRot = FALSE, bMOI = FALSE;
     t_pargs         pa[] = {
         { "-nmol", FALSE, etINT, { &nmol }, "The number of molecules to analyze" },
+        { "-nthreads",
+          FALSE,
+          etINT,
+          { &nthreads },
+          "Number of threads analysing molecules in parallel, nthreads <= 0 means the maximum "
+          "number of threads. Requires linking with OpenMP." },
+        { "-binw",
+          FALSE,
+          etREAL,
+          { &binw },
+          "Bin width (nm) of the -dist distribution" },
         { "-mw",
           FALSE,
           etBOOL,
@@ -231,13 +272,13 @@ int gmx_gyrate(int argc, char* argv[])
     t_topology                 top;
     PbcType                    pbcType;
     rvec *                     x, *x_s;
-    rvec                       xcm, gvec, gvec1;
+    rvec                       xcm, gvec;
     matrix                     box, trans;
     gmx_bool                   bACF;
     real**                     moi_trans = nullptr;
     int                        max_moi = 0, delta_moi = 100;
-    rvec                       d, d1; /* eigenvalues of inertia tensor */
-    real                       t, t0, tm, gyro;
+    rvec                       d; /* eigenvalues of inertia tensor */
+    real                       t, t0, gyro;
     int                        natoms;
     char*                      grpname;
     int                        j, m, gnx, nam, mol;
@@ -250,7 +291,8 @@ int gmx_gyrate(int argc, char* argv[])
     t_filenm fnm[] = {
         { efTRX, "-f", nullptr, ffREAD },      { efTPS, nullptr, nullptr, ffREAD },
         { efNDX, nullptr, nullptr, ffOPTRD },  { efXVG, nullptr, "gyrate", ffWRITE },
-        { efXVG, "-acf", "moi-acf", ffOPTWR },
+        { efXVG, "-acf", "moi-acf", ffOPTWR }, { efDAT, "-om", "gyrate-mol", ffOPTWR },
+        { efXVG, "-dist", "gyrate-dist", ffOPTWR },
     };
 #define NFILE asize(fnm)
     int      npargs;
@@ -290,6 +332,25 @@ int gmx_gyrate(int argc, char* argv[])
         printf("Will print radius normalised by charge\n");
     }
 
+    const char* molfn  = opt2fn_null("-om", NFILE, fnm);
+    const char* distfn = opt2fn_null("-dist", NFILE, fnm);
+    if ((molfn || distfn) && nz > 0)
+    {
+        gmx_fatal(FARGS, "-om and -dist can not be combined with -nz");
+    }
+    if (distfn && bMOI)
+    {
+        gmx_fatal(FARGS, "-dist gives the distribution of the radii of gyration, it can not be combined with -moi");
+    }
+    if (distfn && binw <= 0)
+    {
+        gmx_fatal(FARGS, "-binw should be larger than zero");
+    }
+    if (nthreads <= 0)
+    {
+        nthreads = gmx_omp_get_max_threads();
+    }
+
     read_tps_conf(ftp2fn(efTPS, NFILE, fnm), &top, &pbcType, &x, nullptr, box, TRUE);
     get_index(&top.atoms, ftp2fn_null(efNDX, NFILE, fnm), 1, &gnx, &index, &grpname);
 
@@ -299,6 +360,31 @@ int gmx_gyrate(int argc, char* argv[])
     }
     nam = gnx / nmol;
 
+    /* The center weights and the masses of all molecules, in index order */
+    std::vector<real> w_xcm(gnx), mass(gnx);
+    xcm_weights(gnx, index, top.atoms.atom, bQ, bMassW, w_xcm.data());
+    xcm_weights(gnx, index, top.atoms.atom, FALSE, TRUE, mass.data());
+
+    /* Per molecule results of a frame, the running distribution of the radii */
+    rvec *               xg, *gvec_mol, *d_mol;
+    matrix*              trans_mol;
+    std::vector<real>    gyro_mol(nmol);
+    std::vector<int64_t> dist;
+    std::vector<float>   molbuf(4 * nmol);
+    int64_t              ndist = 0, nnonfinite = 0;
+    FILE*                fmol  = nullptr;
+    snew(xg, gnx);
+    snew(gvec_mol, nmol);
+    snew(d_mol, nmol);
+    snew(trans_mol, nmol);
+    if (molfn)
+    {
+        const int32_t head[2] = { nmol, bMOI ? 2 : (bRot ? 1 : 0) };
+        fmol                  = gmx_ffopen(molfn, "wb");
+        gyro_fwrite(c_gyroMolMagic, 1, sizeof(c_gyroMolMagic), fmol);
+        gyro_fwrite(head, sizeof(int32_t), 2, fmol);
+    }
+
     natoms = read_first_x(oenv, &status, ftp2fn(efTRX, NFILE, fnm), &t, &x, box);
     snew(x_s, natoms);
 
@@ -355,23 +441,74 @@ int gmx_gyrate(int argc, char* argv[])
         }
         gyro = 0;
         clear_rvec(gvec);
-        clear_rvec(gvec1);
         clear_rvec(d);
-        clear_rvec(d1);
-        for (mol = 0; mol < nmol; mol++)
+        if (nz == 0)
         {
-            tm = sub_xcm(nz == 0 ? x_s : x, nam, index + mol * nam, top.atoms.atom, xcm, bQ, bMassW);
-            if (nz == 0)
+            calc_gyro_mols(nmol,
+                           nam,
+                           index,
+                           x_s,
+                           xg,
+                           w_xcm.data(),
+                           mass.data(),
+                           bRot,
+                           bMOI,
+                           gyro_mol.data(),
+                           gvec_mol,
+                           d_mol,
+                           trans_mol,
+                           nthreads);
+            for (mol = 0; mol < nmol; mol++)
             {
-                gyro += calc_gyro(
-                        x_s, nam, index + mol * nam, top.atoms.atom, tm, gvec1, d1, bMassW, bQ, bRot, bMOI, trans);
+                gyro += gyro_mol[mol];
+                rvec_inc(gvec, gvec_mol[mol]);
+                rvec_inc(d, d_mol[mol]);
             }
-            else
+            if (bRot)
+            {
+                copy_mat(trans_mol[nmol - 1], trans);
+            }
+            if (fmol)
+            {
+                for (mol = 0; mol < nmol; mol++)
+                {
+                    const real* comp = bRot ? d_mol[mol] : gvec_mol[mol];
+                    molbuf[4 * mol]  = gyro_mol[mol];
+                    for (m = 0; (m < DIM); m++)
+                    {
+                        molbuf[4 * mol + 1 + m] = comp[m];
+                    }
+                }
+                const double time = t;
+                gyro_fwrite(&time, sizeof(time), 1, fmol);
+                gyro_fwrite(molbuf.data(), sizeof(float), molbuf.size(), fmol);
+            }
+            if (distfn)
+            {
+                for (mol = 0; mol < nmol; mol++)
+                {
+                    if (!std::isfinite(gyro_mol[mol]))
+                    {
+                        nnonfinite++;
+                        continue;
+                    }
+                    const std::size_t bin = static_cast<std::size_t>(gyro_mol[mol] / binw);
+                    if (bin >= dist.size())
+                    {
+                        dist.resize(bin + 1, 0);
+                    }
+                    dist[bin]++;
+                    ndist++;
+                }
+            }
+        }
+        else
+        {
+            for (mol = 0; mol < nmol; mol++)
             {
+                sub_xcm_weighted(x, nam, index + mol * nam, w_xcm.data() + mol * nam, xcm);
                 calc_gyro_z(x, box, nam, index + mol * nam, top.atoms.atom, nz, t, out);
             }
-            rvec_inc(gvec, gvec1);
-            rvec_inc(d, d1);
         }
         if (nmol > 0)
         {
@@ -413,6 +550,35 @@ int gmx_gyrate(int argc, char* argv[])
 
     xvgrclose(out);
 
+    sfree(xg);
+    sfree(gvec_mol);
+    sfree(d_mol);
+    sfree(trans_mol);
+    if (fmol)
+    {
+        gmx_ffclose(fmol);
+    }
+    if (distfn)
+    {
+        if (nnonfinite > 0)
+        {
+            fprintf(stderr,
+                    "\nWARNING: %ld radii of gyration that are not finite were left out of %s\n",
+                    static_cast<long>(nnonfinite),
+                    distfn);
+        }
+        FILE* fp = xvgropen(distfn,
+                            "Distribution of the radii of gyration of the molecules",
+                            bQ ? "Rq (nm)" : "Rg (nm)",
+                            "P (1/nm)",
+                            oenv);
+        for (std::size_t b = 0; b < dist.size(); b++)
+        {
+            fprintf(fp, "%10g  %10g\n", (b + 0.5) * binw, dist[b] / (ndist * binw));
+        }
+        xvgrclose(fp);
+    }
+
     if (bACF)
     {
         int mode = eacVector;
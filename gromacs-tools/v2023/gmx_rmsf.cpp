@@ -235,7 +235,7 @@ int gmx_rmsf(int argc, char* argv[])
     };
     int  natom;
     int  i, m, teller = 0;
-    real t, *w_rls;
+    real t, *w_rls, *w_xcm;
 
     t_topology top;
     PbcType    pbcType;
@@ -309,6 +309,9 @@ int gmx_rmsf(int argc, char* argv[])
             w_rls[index[i]] = 1;
         }
     }
+    /* The same weights in index order, for removing the center of mass */
+    snew(w_xcm, isize);
+    xcm_weights(isize, index, top.atoms.atom, FALSE, bMassWeighted, w_xcm);
 
     /* Malloc the rmsf arrays */
     snew(xav, isize * DIM);
@@ -351,7 +354,7 @@ int gmx_rmsf(int argc, char* argv[])
 
     if (bFit)
     {
-        sub_xcm(xref, isize, index, top.atoms.atom, xcm, FALSE, bMassWeighted);
+        sub_xcm_weighted(xref, isize, index, w_xcm, xcm);
     }
 
     natom = read_first_x(oenv, &status, ftp2fn(efTRX, NFILE, fnm), &t, &x, box);
@@ -379,7 +382,7 @@ int gmx_rmsf(int argc, char* argv[])
             gmx_rmpbc(gpbc, natom, box, x);
 
             /* Set center of mass to zero */
-            sub_xcm(x, isize, index, top.atoms.atom, xcm, FALSE, bMassWeighted);
+            sub_xcm_weighted(x, isize, index, w_xcm, xcm);
 
             /* Fit to reference structure */
             do_fit(natom, w_rls, xref, x);
@@ -503,6 +506,7 @@ int gmx_rmsf(int argc, char* argv[])
         sfree(U[i]);
     }
     sfree(U);
+    sfree(w_xcm);
 
     /* Write RMSF output */
     if (bReadPDB)
@@ -38,167 +38,230 @@
 
 #include <cmath>
 
+#include <algorithm>
+
 #include "gromacs/math/functions.h"
-#include "gromacs/math/nrjac.h"
+#include "gromacs/math/units.h"
 #include "gromacs/math/vec.h"
 #include "gromacs/topology/topology.h"
-#include "gromacs/utility/smalloc.h"
-
-#define NDIM 4
 
-#ifdef DEBUG
-static void m_op(matrix mat, rvec x)
+/* Eigenvalues and eigenvectors of the symmetric inertia tensor a, in double precision.
+ * The eigenvalues follow from the characteristic polynomial in closed form. The
+ * eigenvector of the eigenvalue furthest from the other two is the cross product of two
+ * rows of a - lambda 1, the other two follow from the 2x2 problem in the plane
+ * perpendicular to it, which also handles (nearly) degenerate eigenvalues.
+ * The eigenvalues are returned in ascending order of magnitude in d, the eigenvectors
+ * in the rows of trans, with their largest component positive.
+ */
+static void inertia_eigen(const double a[DIM][DIM], matrix trans, rvec d)
 {
-    rvec xp;
-    int  m;
+    double ev[DIM], v[DIM][DIM];
 
-    for (m = 0; (m < DIM); m++)
+    const double p1 = gmx::square(a[XX][YY]) + gmx::square(a[XX][ZZ]) + gmx::square(a[YY][ZZ]);
+    const double q  = (a[XX][XX] + a[YY][YY] + a[ZZ][ZZ]) / 3;
+    const double p2 = gmx::square(a[XX][XX] - q) + gmx::square(a[YY][YY] - q)
+                      + gmx::square(a[ZZ][ZZ] - q) + 2 * p1;
+    if (p2 == 0)
     {
-        xp[m] = mat[m][XX] * x[XX] + mat[m][YY] * x[YY] + mat[m][ZZ] * x[ZZ];
+        /* a multiple of the unit matrix */
+        for (int i = 0; i < DIM; i++)
+        {
+            ev[i] = a[i][i];
+            for (int m = 0; m < DIM; m++)
+            {
+                v[i][m] = (i == m) ? 1 : 0;
+            }
+        }
     }
-    fprintf(stderr, "x    %8.3f  %8.3f  %8.3f\n", x[XX], x[YY], x[ZZ]);
-    fprintf(stderr, "xp   %8.3f  %8.3f  %8.3f\n", xp[XX], xp[YY], xp[ZZ]);
-    fprintf(stderr, "fac  %8.3f  %8.3f  %8.3f\n", xp[XX] / x[XX], xp[YY] / x[YY], xp[ZZ] / x[ZZ]);
-}
-
-static void ptrans(char* s, real** inten, real d[], real e[])
-{
-    int  m;
-    real n, x, y, z;
-    for (m = 1; (m < NDIM); m++)
+    else
     {
-        x = inten[m][1];
-        y = inten[m][2];
-        z = inten[m][3];
-        n = x * x + y * y + z * z;
-        fprintf(stderr, "%8s %8.3f %8.3f %8.3f, norm:%8.3f, d:%8.3f, e:%8.3f\n", s, x, y, z, std::sqrt(n), d[m], e[m]);
-    }
-    fprintf(stderr, "\n");
-}
+        const double p = std::sqrt(p2 / 6);
+        double       b[DIM][DIM];
+        for (int i = 0; i < DIM; i++)
+        {
+            for (int m = 0; m < DIM; m++)
+            {
+                b[i][m] = (a[i][m] - (i == m ? q : 0)) / p;
+            }
+        }
+        double r = 0.5
+                   * (b[XX][XX] * (b[YY][YY] * b[ZZ][ZZ] - b[YY][ZZ] * b[ZZ][YY])
+                      - b[XX][YY] * (b[YY][XX] * b[ZZ][ZZ] - b[YY][ZZ] * b[ZZ][XX])
+                      + b[XX][ZZ] * (b[YY][XX] * b[ZZ][YY] - b[YY][YY] * b[ZZ][XX]));
+        r                = std::min(1.0, std::max(-1.0, r));
+        const double phi = std::acos(r) / 3;
+        const double e0  = q + 2 * p * std::cos(phi);
+        const double e2  = q + 2 * p * std::cos(phi + 2 * M_PI / 3);
+        const double e1  = 3 * q - e0 - e2;
 
-void t_trans(matrix trans, real d[], real** ev)
-{
-    rvec x;
-    int  j;
-    for (j = 0; (j < DIM); j++)
-    {
-        x[XX] = ev[1][j + 1];
-        x[YY] = ev[2][j + 1];
-        x[ZZ] = ev[3][j + 1];
-        m_op(trans, x);
-        fprintf(stderr, "d[%d]=%g\n", j, d[j + 1]);
-    }
-}
-#endif
+        /* the eigenvalue that is best separated from the other two */
+        const double ea = (e0 - e1 > e1 - e2) ? e0 : e2;
+        double       row[DIM][DIM];
+        for (int i = 0; i < DIM; i++)
+        {
+            for (int m = 0; m < DIM; m++)
+            {
+                row[i][m] = a[i][m] - (i == m ? ea : 0);
+            }
+        }
+        double c[DIM][DIM], cmax = -1;
+        int    imax = 0;
+        for (int i = 0; i < DIM; i++)
+        {
+            const double* r0 = row[i];
+            const double* r1 = row[(i + 1) % DIM];
+            c[i][XX]         = r0[YY] * r1[ZZ] - r0[ZZ] * r1[YY];
+            c[i][YY]         = r0[ZZ] * r1[XX] - r0[XX] * r1[ZZ];
+            c[i][ZZ]         = r0[XX] * r1[YY] - r0[YY] * r1[XX];
+            const double c2  = gmx::square(c[i][XX]) + gmx::square(c[i][YY]) + gmx::square(c[i][ZZ]);
+            if (c2 > cmax)
+            {
+                cmax = c2;
+                imax = i;
+            }
+        }
+        double va[DIM];
+        for (int m = 0; m < DIM; m++)
+        {
+            va[m] = c[imax][m] / std::sqrt(cmax);
+        }
 
-void principal_comp(int n, const int index[], t_atom atom[], rvec x[], matrix trans, rvec d)
-{
-    int      i, j, ai, m, nrot;
-    real     mm, rx, ry, rz;
-    double **inten, dd[NDIM], tvec[NDIM], **ev;
-#ifdef DEBUG
-    real e[NDIM];
-#endif
-    real temp;
-
-    snew(inten, NDIM);
-    snew(ev, NDIM);
-    for (i = 0; (i < NDIM); i++)
-    {
-        snew(inten[i], NDIM);
-        snew(ev[i], NDIM);
-        dd[i] = 0.0;
-#ifdef DEBUG
-        e[i] = 0.0;
-#endif
-    }
+        /* orthonormal u, w perpendicular to va */
+        double u[DIM], w[DIM];
+        if (std::abs(va[XX]) > std::abs(va[YY]))
+        {
+            const double n = std::sqrt(va[XX] * va[XX] + va[ZZ] * va[ZZ]);
+            u[XX]          = -va[ZZ] / n;
+            u[YY]          = 0;
+            u[ZZ]          = va[XX] / n;
+        }
+        else
+        {
+            const double n = std::sqrt(va[YY] * va[YY] + va[ZZ] * va[ZZ]);
+            u[XX]          = 0;
+            u[YY]          = va[ZZ] / n;
+            u[ZZ]          = -va[YY] / n;
+        }
+        w[XX] = va[YY] * u[ZZ] - va[ZZ] * u[YY];
+        w[YY] = va[ZZ] * u[XX] - va[XX] * u[ZZ];
+        w[ZZ] = va[XX] * u[YY] - va[YY] * u[XX];
 
-    for (i = 0; (i < NDIM); i++)
-    {
-        for (m = 0; (m < NDIM); m++)
+        /* the 2x2 problem in the u, w plane */
+        double au[DIM], aw[DIM];
+        for (int i = 0; i < DIM; i++)
         {
-            inten[i][m] = 0;
+            au[i] = a[i][XX] * u[XX] + a[i][YY] * u[YY] + a[i][ZZ] * u[ZZ];
+            aw[i] = a[i][XX] * w[XX] + a[i][YY] * w[YY] + a[i][ZZ] * w[ZZ];
+        }
+        const double uu    = u[XX] * au[XX] + u[YY] * au[YY] + u[ZZ] * au[ZZ];
+        const double uw    = w[XX] * au[XX] + w[YY] * au[YY] + w[ZZ] * au[ZZ];
+        const double ww    = w[XX] * aw[XX] + w[YY] * aw[YY] + w[ZZ] * aw[ZZ];
+        const double theta = 0.5 * std::atan2(2 * uw, uu - ww);
+        const double ct    = std::cos(theta);
+        const double st    = std::sin(theta);
+        ev[0]              = ea;
+        ev[1] = ct * ct * uu + 2 * ct * st * uw + st * st * ww;
+        ev[2] = st * st * uu - 2 * ct * st * uw + ct * ct * ww;
+        for (int m = 0; m < DIM; m++)
+        {
+            v[0][m] = va[m];
+            v[1][m] = ct * u[m] + st * w[m];
+            v[2][m] = -st * u[m] + ct * w[m];
         }
     }
-    for (i = 0; (i < n); i++)
+
+    /* Sort eigenvalues in ascending order */
+    int order[DIM] = { 0, 1, 2 };
+    for (int pass = 0; pass < DIM - 1; pass++)
     {
-        ai = index[i];
-        mm = atom[ai].m;
-        rx = x[ai][XX];
-        ry = x[ai][YY];
-        rz = x[ai][ZZ];
-        inten[0][0] += mm * (gmx::square(ry) + gmx::square(rz));
-        inten[1][1] += mm * (gmx::square(rx) + gmx::square(rz));
-        inten[2][2] += mm * (gmx::square(rx) + gmx::square(ry));
-        inten[1][0] -= mm * (ry * rx);
-        inten[2][0] -= mm * (rx * rz);
-        inten[2][1] -= mm * (rz * ry);
+        for (int i = 0; i < DIM - 1 - pass; i++)
+        {
+            if (std::abs(ev[order[i + 1]]) < std::abs(ev[order[i]]))
+            {
+                std::swap(order[i], order[i + 1]);
+            }
+        }
     }
-    inten[0][1] = inten[1][0];
-    inten[0][2] = inten[2][0];
-    inten[1][2] = inten[2][1];
-#ifdef DEBUG
-    ptrans("initial", inten, dd, e);
-#endif
-
-    for (i = 0; (i < DIM); i++)
+    for (int i = 0; i < DIM; i++)
     {
-        for (m = 0; (m < DIM); m++)
+        const double* vi   = v[order[i]];
+        int           mmax = 0;
+        for (int m = 1; m < DIM; m++)
+        {
+            if (std::abs(vi[m]) > std::abs(vi[mmax]))
+            {
+                mmax = m;
+            }
+        }
+        const double sign = (vi[mmax] < 0) ? -1 : 1;
+        d[i]              = ev[order[i]];
+        for (int m = 0; m < DIM; m++)
         {
-            trans[i][m] = inten[i][m];
+            trans[i][m] = sign * vi[m];
         }
     }
+}
 
-    /* Call numerical recipe routines */
-    jacobi(inten, 3, dd, ev, &nrot);
-#ifdef DEBUG
-    ptrans("jacobi", ev, dd, e);
-#endif
-
-    /* Sort eigenvalues in ascending order */
-#define SWAPPER(i)                               \
-    if (std::abs(dd[(i) + 1]) < std::abs(dd[i])) \
-    {                                            \
-        temp = dd[i];                            \
-        for (j = 0; (j < NDIM); j++)             \
-        {                                        \
-            tvec[j] = ev[j][i];                  \
-        }                                        \
-        dd[i] = dd[(i) + 1];                     \
-        for (j = 0; (j < NDIM); j++)             \
-        {                                        \
-            ev[j][i] = ev[j][(i) + 1];           \
-        }                                        \
-        dd[(i) + 1] = temp;                      \
-        for (j = 0; (j < NDIM); j++)             \
-        {                                        \
-            ev[j][(i) + 1] = tvec[j];            \
-        }                                        \
-    }
-    SWAPPER(0)
-    SWAPPER(1)
-    SWAPPER(0)
-#ifdef DEBUG
-    ptrans("swap", ev, dd, e);
-    t_trans(trans, dd, ev);
-#endif
-
-    for (i = 0; (i < DIM); i++)
+/* The inertia tensor of the atoms in index with coordinates relative to xc */
+static void inertia_tensor(int n, const int index[], const t_atom atom[], const rvec x[], const rvec xc, double inten[DIM][DIM])
+{
+    for (int i = 0; (i < DIM); i++)
     {
-        d[i] = dd[i];
-        for (m = 0; (m < DIM); m++)
+        for (int m = 0; (m < DIM); m++)
         {
-            trans[i][m] = ev[m][i];
+            inten[i][m] = 0;
         }
     }
+    for (int i = 0; (i < n); i++)
+    {
+        const int    ai = index[i];
+        const double mm = atom[ai].m;
+        const double rx = x[ai][XX] - xc[XX];
+        const double ry = x[ai][YY] - xc[YY];
+        const double rz = x[ai][ZZ] - xc[ZZ];
+        inten[XX][XX] += mm * (gmx::square(ry) + gmx::square(rz));
+        inten[YY][YY] += mm * (gmx::square(rx) + gmx::square(rz));
+        inten[ZZ][ZZ] += mm * (gmx::square(rx) + gmx::square(ry));
+        inten[YY][XX] -= mm * (ry * rx);
+        inten[ZZ][XX] -= mm * (rx * rz);
+        inten[ZZ][YY] -= mm * (rz * ry);
+    }
+    inten[XX][YY] = inten[YY][XX];
+    inten[XX][ZZ] = inten[ZZ][XX];
+    inten[YY][ZZ] = inten[ZZ][YY];
+}
+
+void principal_comp(int n, const int index[], t_atom atom[], rvec x[], matrix trans, rvec d)
+{
+    const rvec origin = { 0, 0, 0 };
+    double     inten[DIM][DIM];
 
-    for (i = 0; (i < NDIM); i++)
+    inertia_tensor(n, index, atom, x, origin, inten);
+    inertia_eigen(inten, trans, d);
+}
+
+void principal_comp_groups(int ngroup, const int start[], const rvec x[], const real mass[], matrix trans[], rvec d[])
+{
+    for (int g = 0; g < ngroup; g++)
     {
-        sfree(inten[i]);
-        sfree(ev[i]);
+        /* the six independent elements, accumulated over the contiguous atoms of the group */
+        double ixx = 0, iyy = 0, izz = 0, ixy = 0, ixz = 0, iyz = 0;
+        for (int i = start[g]; i < start[g + 1]; i++)
+        {
+            const double mm = mass[i];
+            const double rx = x[i][XX];
+            const double ry = x[i][YY];
+            const double rz = x[i][ZZ];
+            ixx += mm * (ry * ry + rz * rz);
+            iyy += mm * (rx * rx + rz * rz);
+            izz += mm * (rx * rx + ry * ry);
+            ixy -= mm * (rx * ry);
+            ixz -= mm * (rx * rz);
+            iyz -= mm * (ry * rz);
+        }
+        const double inten[DIM][DIM] = { { ixx, ixy, ixz }, { ixy, iyy, iyz }, { ixz, iyz, izz } };
+        inertia_eigen(inten, trans[g], d[g]);
     }
-    sfree(inten);
-    sfree(ev);
 }
 
 void rotate_atoms(int gnx, const int* index, rvec x[], matrix trans)
@@ -218,75 +281,156 @@ void rotate_atoms(int gnx, const int* index, rvec x[], matrix trans)
     }
 }
 
+/* Center of the gnx atoms in index, or the first gnx atoms when bIndex is false, with the
+ * weights given by weight(i, ii) of the i-th atom ii. The weighting is resolved at compile
+ * time and the sums are accumulated in double.
+ */
+template<bool bIndex, class Weight>
+static real xcm_kernel(const rvec x[], int gnx, const int* index, Weight weight, rvec xcm)
+{
+    double tm = 0, sx = 0, sy = 0, sz = 0;
+
+    for (int i = 0; (i < gnx); i++)
+    {
+        const int    ii = bIndex ? index[i] : i;
+        const double m0 = weight(i, ii);
+        tm += m0;
+        sx += m0 * x[ii][XX];
+        sy += m0 * x[ii][YY];
+        sz += m0 * x[ii][ZZ];
+    }
+    xcm[XX] = sx / tm;
+    xcm[YY] = sy / tm;
+    xcm[ZZ] = sz / tm;
+
+    return tm;
+}
+
+template<class Weight>
+static real xcm_dispatch(const rvec x[], int gnx, const int* index, Weight weight, rvec xcm)
+{
+    return index ? xcm_kernel<true>(x, gnx, index, weight, xcm)
+                 : xcm_kernel<false>(x, gnx, index, weight, xcm);
+}
+
+template<bool bIndex>
+static void sub_kernel(rvec x[], int gnx, const int* index, const rvec xcm)
+{
+    for (int i = 0; (i < gnx); i++)
+    {
+        const int ii = bIndex ? index[i] : i;
+        rvec_dec(x[ii], xcm);
+    }
+}
+
+static void sub_dispatch(rvec x[], int gnx, const int* index, const rvec xcm)
+{
+    if (index)
+    {
+        sub_kernel<true>(x, gnx, index, xcm);
+    }
+    else
+    {
+        sub_kernel<false>(x, gnx, index, xcm);
+    }
+}
+
 real calc_xcm(const rvec x[], int gnx, const int* index, const t_atom* atom, rvec xcm, gmx_bool bQ, gmx_bool bMassW)
 {
-    int  i, ii, m;
-    real m0, tm;
+    if (atom && bQ)
+    {
+        return xcm_dispatch(x, gnx, index, [atom](int, int ii) { return std::abs(atom[ii].q); }, xcm);
+    }
+    else if (atom && bMassW)
+    {
+        return xcm_dispatch(x, gnx, index, [atom](int, int ii) { return atom[ii].m; }, xcm);
+    }
+    else
+    {
+        return xcm_dispatch(x, gnx, index, [](int, int) { return 1.0; }, xcm);
+    }
+}
+
+real sub_xcm(rvec x[], int gnx, const int* index, const t_atom atom[], rvec xcm, gmx_bool bQ, gmx_bool bMassW)
+{
+    real tm;
 
-    clear_rvec(xcm);
-    tm = 0;
-    for (i = 0; (i < gnx); i++)
+    tm = calc_xcm(x, gnx, index, atom, xcm, bQ, bMassW);
+    sub_dispatch(x, gnx, index, xcm);
+    return tm;
+}
+
+void xcm_weights(int gnx, const int* index, const t_atom atom[], gmx_bool bQ, gmx_bool bMassW, real w[])
+{
+    for (int i = 0; (i < gnx); i++)
     {
-        ii = index ? index[i] : i;
-        if (atom)
+        const int ii = index ? index[i] : i;
+        if (atom && bQ)
         {
-            if (bQ)
-            {
-                m0 = std::abs(atom[ii].q);
-            }
-            else if (!bMassW)
-            {
-                m0 = 1.;
-            }
-            else
-            {
-                m0 = atom[ii].m;
-            }
+            w[i] = std::abs(atom[ii].q);
         }
-        else
+        else if (atom && bMassW)
         {
-            m0 = 1;
+            w[i] = atom[ii].m;
         }
-        tm += m0;
-        for (m = 0; (m < DIM); m++)
+        else
         {
-            xcm[m] += m0 * x[ii][m];
+            w[i] = 1;
         }
     }
-    for (m = 0; (m < DIM); m++)
-    {
-        xcm[m] /= tm;
-    }
+}
 
-    return tm;
+real calc_xcm_weighted(const rvec x[], int gnx, const int* index, const real w[], rvec xcm)
+{
+    return xcm_dispatch(x, gnx, index, [w](int i, int) { return w[i]; }, xcm);
 }
 
-real sub_xcm(rvec x[], int gnx, const int* index, const t_atom atom[], rvec xcm, gmx_bool bQ, gmx_bool bMassW)
+real sub_xcm_weighted(rvec x[], int gnx, const int* index, const real w[], rvec xcm)
 {
-    int  i, ii;
     real tm;
 
-    tm = calc_xcm(x, gnx, index, atom, xcm, bQ, bMassW);
-    for (i = 0; (i < gnx); i++)
+    tm = calc_xcm_weighted(x, gnx, index, w, xcm);
+    sub_dispatch(x, gnx, index, xcm);
+    return tm;
+}
+
+/* Set x to trans (x - xc) + xc and v to trans v for the atoms in index, or the first n
+ * atoms when index is nullptr, in a single pass.
+ */
+static void transform_atoms(int n, const int* index, rvec x[], rvec* v, const matrix trans, const rvec xc)
+{
+    for (int i = 0; (i < n); i++)
     {
-        ii = index ? index[i] : i;
-        rvec_dec(x[ii], xcm);
+        const int  ii = index ? index[i] : i;
+        const real xt = x[ii][XX] - xc[XX];
+        const real yt = x[ii][YY] - xc[YY];
+        const real zt = x[ii][ZZ] - xc[ZZ];
+        x[ii][XX]     = trans[XX][XX] * xt + trans[XX][YY] * yt + trans[XX][ZZ] * zt + xc[XX];
+        x[ii][YY]     = trans[YY][XX] * xt + trans[YY][YY] * yt + trans[YY][ZZ] * zt + xc[YY];
+        x[ii][ZZ]     = trans[ZZ][XX] * xt + trans[ZZ][YY] * yt + trans[ZZ][ZZ] * zt + xc[ZZ];
+        if (v)
+        {
+            const real vx = v[ii][XX];
+            const real vy = v[ii][YY];
+            const real vz = v[ii][ZZ];
+            v[ii][XX]     = trans[XX][XX] * vx + trans[XX][YY] * vy + trans[XX][ZZ] * vz;
+            v[ii][YY]     = trans[YY][XX] * vx + trans[YY][YY] * vy + trans[YY][ZZ] * vz;
+            v[ii][ZZ]     = trans[ZZ][XX] * vx + trans[ZZ][YY] * vy + trans[ZZ][ZZ] * vz;
+        }
     }
-    return tm;
 }
 
-void orient_princ(const t_atoms* atoms, int isize, const int* index, int natoms, rvec x[], rvec* v, rvec d)
+/* The rotation to the principal axes of the atoms in index about their center of mass xcm,
+ * without the mirroring
+ */
+static void princ_rotation(const t_atoms* atoms, int isize, const int* index, const rvec x[], rvec xcm, matrix trans, rvec d)
 {
-    int    i, m;
-    rvec   xcm, prcomp;
-    matrix trans;
+    double inten[DIM][DIM];
+    rvec   prcomp;
 
     calc_xcm(x, isize, index, atoms->atom, xcm, FALSE);
-    for (i = 0; i < natoms; i++)
-    {
-        rvec_dec(x[i], xcm);
-    }
-    principal_comp(isize, index, atoms->atom, x, trans, prcomp);
+    inertia_tensor(isize, index, atoms->atom, x, xcm, inten);
+    inertia_eigen(inten, trans, prcomp);
     if (d)
     {
         copy_rvec(prcomp, d);
@@ -295,19 +439,27 @@ void orient_princ(const t_atoms* atoms, int isize, const int* index, int natoms,
     /* Check whether this trans matrix mirrors the molecule */
     if (det(trans) < 0)
     {
-        for (m = 0; (m < DIM); m++)
+        for (int m = 0; (m < DIM); m++)
         {
             trans[ZZ][m] = -trans[ZZ][m];
         }
     }
-    rotate_atoms(natoms, nullptr, x, trans);
-    if (v)
-    {
-        rotate_atoms(natoms, nullptr, v, trans);
-    }
+}
 
-    for (i = 0; i < natoms; i++)
-    {
-        rvec_inc(x[i], xcm);
-    }
+void orient_princ(const t_atoms* atoms, int isize, const int* index, int natoms, rvec x[], rvec* v, rvec d)
+{
+    rvec   xcm;
+    matrix trans;
+
+    princ_rotation(atoms, isize, index, x, xcm, trans, d);
+    transform_atoms(natoms, nullptr, x, v, trans, xcm);
+}
+
+void orient_princ_group(const t_atoms* atoms, int isize, const int* index, rvec x[], rvec* v, rvec d)
+{
+    rvec   xcm;
+    matrix trans;
+
+    princ_rotation(atoms, isize, index, x, xcm, trans, d);
+    transform_atoms(isize, index, x, v, trans, xcm);
 }
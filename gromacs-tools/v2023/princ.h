@@ -46,11 +46,21 @@ void rotate_atoms(int gnx, const int index[], rvec x[], matrix trans);
 void principal_comp(int n, const int index[], t_atom atom[], rvec x[], matrix trans, rvec d);
 /* Calculate the principal components of atoms in index. Atoms are
  * mass weighted. It is assumed that the center of mass is in the origin!
+ * The eigenvalues are returned in d in ascending order, the principal axes in the rows of trans.
+ */
+
+void principal_comp_groups(int ngroup, const int start[], const rvec x[], const real mass[], matrix trans[], rvec d[]);
+/* Calculate the principal components of ngroup groups of atoms stored contiguously,
+ * group g being the atoms start[g] to start[g+1] of x with masses mass. The coordinates
+ * of each group should be relative to its center of mass. Results as for principal_comp.
  */
 
 void orient_princ(const t_atoms* atoms, int isize, const int* index, int natoms, rvec x[], rvec* v, rvec d);
 /* rotates molecule to align principal axes with coordinate axes */
 
+void orient_princ_group(const t_atoms* atoms, int isize, const int* index, rvec x[], rvec* v, rvec d);
+/* as orient_princ, but only rotates the atoms in index */
+
 real calc_xcm(const rvec x[], int gnx, const int* index, const t_atom* atom, rvec xcm, gmx_bool bQ, gmx_bool bMassW = true);
 /* Calculate the center of mass of the atoms in index. if bQ then the atoms
  * will be charge weighted rather than mass weighted.
@@ -63,4 +73,15 @@ real sub_xcm(rvec x[], int gnx, const int* index, const t_atom atom[], rvec xcm,
  * Returns the total mass
  */
 
+void xcm_weights(int gnx, const int* index, const t_atom atom[], gmx_bool bQ, gmx_bool bMassW, real w[]);
+/* Store the weights calc_xcm would use for the atoms in index in w[0] to w[gnx-1],
+ * so that they can be reused for every frame with calc_xcm_weighted and sub_xcm_weighted.
+ */
+
+real calc_xcm_weighted(const rvec x[], int gnx, const int* index, const real w[], rvec xcm);
+/* As calc_xcm, with the weights w of the atoms in index from xcm_weights */
+
+real sub_xcm_weighted(rvec x[], int gnx, const int* index, const real w[], rvec xcm);
+/* As sub_xcm, with the weights w of the atoms in index from xcm_weights */
+
 #endif